@@ -0,0 +1,30 @@
+#/usr/bin bash
+
+# Usage: ./bench.sh [scenario size]...
+# Without arguments every scenario is run at its default size.
+# With PERF=1, hardware counters are also reported per order (needs perf).
+
+set -e
+
+if [ $# -eq 0 ]; then
+  set -- drain 20000 restock 20000 orders 1000000 waiting 1000000 blocked 100000 runs 200000 empty 100000 release 200000 manifest 1000000 couriers 1000000
+fi
+
+mkdir -p bench_traces
+while [ $# -ge 2 ]; do
+  trace=bench_traces/$1-$2.txt
+  if [ ! -f $trace ]; then
+    python3 bench/gen_trace.py $1 $2 > $trace
+  fi
+
+  echo "Running $1 ($2)"
+  time ./main < $trace > /dev/null
+  if [ "$PERF" = "1" ]; then
+    n_orders=$(grep -c '^ordine' $trace || true)
+    perf stat -x, -e LLC-load-misses,instructions ./main < $trace \
+      2>&1 > /dev/null | awk -F, -v n=$n_orders \
+      '$1 ~ /^[0-9]+$/ { printf "%s per order: %.2f\n", $3, $1 / n }'
+  fi
+  echo -e "----------------------\n"
+  shift 2
+done
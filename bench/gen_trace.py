@@ -0,0 +1,233 @@
+#!/usr/bin/env python3
+"""Generate synthetic command traces for bench.sh.
+
+Usage: gen_trace.py <scenario> <size> [seed] > trace.txt
+"""
+
+import random
+import sys
+
+
+def drain(size, rnd):
+    # Many small lots of one ingredient, drained by few large orders.
+    lots_per_line = 64
+    print(1000000, 1000000000)
+    print("aggiungi_ricetta pane farina 1")
+    for t in range(size):
+        lots = " ".join(
+            "farina 1 %d" % (1000000 + t * lots_per_line + i)
+            for i in range(lots_per_line)
+        )
+        print("rifornimento", lots)
+        if t % 16 == 15:
+            print("ordine pane", 16 * lots_per_line - rnd.randint(0, 8))
+
+
+def restock(size, rnd):
+    # Long restock lines repeating a few ingredients with shuffled expiries.
+    names = ["farina", "uova", "zucchero", "burro", "latte", "cioccolato"]
+    print(1000000, 1000000000)
+    print("aggiungi_ricetta torta", " ".join("%s 1" % n for n in names))
+    for t in range(size):
+        lots = " ".join(
+            "%s %d %d" % (rnd.choice(names), rnd.randint(1, 50),
+                          1000000 + 20 * t + rnd.randint(0, 100))
+            for _ in range(48)
+        )
+        print("rifornimento", lots)
+        if t % 8 == 7:
+            print("ordine torta", rnd.randint(100, 1500))
+
+
+def orders(size, rnd):
+    # Orders for random recipes over a large catalogue, so that recipes and
+    # stocks do not fit in the last-level cache.
+    n_ingredients = 100000
+    n_recipes = 200000
+    print(1000000000, 1)
+    for r in range(n_recipes):
+        ingredients = rnd.sample(range(n_ingredients), 6)
+        print("aggiungi_ricetta r%d" % r,
+              " ".join("i%d %d" % (i, rnd.randint(1, 5)) for i in ingredients))
+    for i in range(0, n_ingredients, 50):
+        print("rifornimento", " ".join(
+            "i%d 1000000 1000000000" % j for j in range(i, i + 50)))
+    for t in range(size):
+        print("ordine r%d" % rnd.randrange(n_recipes), rnd.randint(1, 3))
+
+
+def waiting(size, rnd):
+    # Orders that stay in the waiting queue, each recipe lacking one ingredient
+    # that is never restocked, so every restock rescans the whole queue.
+    n_ingredients = 100000
+    n_recipes = 100000
+    print(1000000000, 1)
+    for r in range(n_recipes):
+        ingredients = ["i%d" % i for i in rnd.sample(range(n_ingredients), 5)]
+        ingredients.insert(rnd.randrange(6), "mancante%d" % r)
+        print("aggiungi_ricetta r%d" % r,
+              " ".join("%s %d" % (i, rnd.randint(1, 5)) for i in ingredients))
+    for i in range(0, n_ingredients, 50):
+        print("rifornimento", " ".join(
+            "i%d 1000000 1000000000" % j for j in range(i, i + 50)))
+    for t in range(size):
+        print("ordine r%d" % rnd.randrange(n_recipes), rnd.randint(1, 3))
+    for t in range(20):
+        print("rifornimento i%d 1 1000000000" % rnd.randrange(n_ingredients))
+
+
+def blocked(size, rnd):
+    # A few recipes sharing a scarce ingredient, restocked a little at a time:
+    # every restock wakes up a long queue of orders for the same recipes, most
+    # of which are still short.
+    names = ["i%d" % i for i in range(30)]
+    print(1000000000, 1)
+    for r in range(50):
+        ingredients = rnd.sample(names, 5) + ["lievito"]
+        rnd.shuffle(ingredients)
+        print("aggiungi_ricetta r%d" % r,
+              " ".join("%s %d" % (i, rnd.randint(1, 5)) for i in ingredients))
+    print("rifornimento", " ".join("%s 1000000000 1000000000" % n for n in names))
+    for t in range(size):
+        print("ordine r%d" % rnd.randrange(50), rnd.randint(1, 5))
+        if t % 100 == 99:
+            print("rifornimento lievito %d 1000000000" % rnd.randint(50, 150))
+
+
+def runs(size, rnd):
+    # Long streams of identical orders piling up during a shortage, released
+    # a few hundred at a time by restocks of the scarce ingredient.
+    names = ["i%d" % i for i in range(30)]
+    print(1000000000, 1)
+    for r in range(20):
+        ingredients = rnd.sample(names, 5) + ["lievito"]
+        rnd.shuffle(ingredients)
+        print("aggiungi_ricetta r%d" % r,
+              " ".join("%s %d" % (i, rnd.randint(1, 5)) for i in ingredients))
+    print("rifornimento", " ".join("%s 1000000000 1000000000" % n for n in names))
+    t = 0
+    while t < size:
+        recipe, amount = rnd.randrange(20), rnd.randint(1, 3)
+        for _ in range(rnd.randint(500, 2000)):
+            print("ordine r%d %d" % (recipe, amount))
+            t += 1
+            if t % 1000 == 0:
+                print("rifornimento lievito %d 1000000000" % rnd.randint(500, 3000))
+
+
+def empty(size, rnd):
+    # Thousands of recipes over a few dozen ingredients, a third of which are
+    # out of stock at any time, so most orders fail on an empty stock.
+    names = ["i%d" % i for i in range(48)]
+    n_recipes = 100000
+    print(1000000000, 1)
+    for r in range(n_recipes):
+        print("aggiungi_ricetta r%d" % r, " ".join(
+            "%s %d" % (n, rnd.randint(1, 5)) for n in rnd.sample(names, 8)))
+    for t in range(size):
+        if t % 1000 == 0:
+            # Only the first two thirds of the ingredients, rotated
+            shift = t // 1000
+            print("rifornimento", " ".join(
+                "%s 500 1000000000" % names[(shift + k) % len(names)]
+                for k in range(32)))
+        print("ordine r%d" % rnd.randrange(n_recipes), rnd.randint(1, 3))
+
+
+def rescan(size, rnd):
+    # Hundreds of thousands of recipes with one waiting order each, all short
+    # of a scarce ingredient, so every restock of it wakes and checks them all.
+    names = ["i%d" % i for i in range(1000)]
+    n_recipes = 200000
+    print(1000000000, 1)
+    for r in range(n_recipes):
+        ingredients = rnd.sample(names, 7) + ["lievito"]
+        rnd.shuffle(ingredients)
+        print("aggiungi_ricetta r%d" % r, " ".join(
+            "%s %d" % (i, rnd.randint(2, 5)) for i in ingredients))
+    for i in range(0, len(names), 50):
+        print("rifornimento", " ".join(
+            "%s 1000000000 1000000000" % n for n in names[i:i + 50]))
+    for r in range(n_recipes):
+        print("ordine r%d" % r, rnd.randint(1, 3))
+    for t in range(size):
+        print("rifornimento lievito 1 1000000000")
+
+
+def shortage(size, rnd):
+    # A long shortage of a shared ingredient: orders for a few recipes pile up
+    # in the waiting queue, and the final restocks only release a few of them.
+    print(1000000000, 1)
+    for r in range(20):
+        print("aggiungi_ricetta r%d farina %d lievito 1" % (r, rnd.randint(1, 5)))
+    print("rifornimento farina 1000000000 1000000000")
+    for t in range(size):
+        print("ordine r%d" % rnd.randrange(20), rnd.randint(1, 3))
+    for t in range(10):
+        print("rifornimento lievito %d 1000000000" % (size // 1000))
+
+
+def release(size, rnd):
+    # Ready orders pile up in the truck queue while the truck never comes, and
+    # each restock releases a waiting order that arrived just before the
+    # newest of them.
+    print(1000000000, 1000000000)
+    print("aggiungi_ricetta pane farina 1")
+    print("aggiungi_ricetta torta farina 1 lievito 1")
+    print("rifornimento farina 1000000000 1000000000")
+    for t in range(size):
+        print("ordine pane", rnd.randint(1, 3))
+        if t % 4 == 0:
+            print("ordine torta 1")
+        elif t % 4 == 3:
+            print("rifornimento lievito 1 1000000000")
+
+
+def manifest(size, rnd):
+    # A truck that comes every 20000 commands and takes every ready order, so
+    # each load lists thousands of orders sorted by weight.
+    print(20000, 1000000000)
+    for r in range(100):
+        print("aggiungi_ricetta r%d farina %d" % (r, rnd.randint(1, 50)))
+    print("rifornimento farina 1000000000 1000000000")
+    for t in range(size):
+        print("ordine r%d" % rnd.randrange(100), rnd.randint(1, 20))
+
+
+def couriers(size, rnd):
+    # A fleet of thousands of vans with their own schedules and capacities,
+    # most of them idle at any given time.
+    print(" ".join("%d %d" % (rnd.randint(1000, 100000), rnd.randint(50, 500))
+                   for _ in range(5000)))
+    for r in range(100):
+        print("aggiungi_ricetta r%d farina %d" % (r, rnd.randint(1, 5)))
+    print("rifornimento farina 1000000000 1000000000")
+    for t in range(size):
+        print("ordine r%d" % rnd.randrange(100), rnd.randint(1, 5))
+
+
+SCENARIOS = {
+    "drain": drain,
+    "restock": restock,
+    "orders": orders,
+    "waiting": waiting,
+    "blocked": blocked,
+    "runs": runs,
+    "empty": empty,
+    "rescan": rescan,
+    "shortage": shortage,
+    "release": release,
+    "manifest": manifest,
+    "couriers": couriers,
+}
+
+
+def main():
+    if len(sys.argv) < 3 or sys.argv[1] not in SCENARIOS:
+        sys.exit("usage: gen_trace.py {%s} <size> [seed]" % ",".join(SCENARIOS))
+    seed = int(sys.argv[3]) if len(sys.argv) > 3 else 42
+    SCENARIOS[sys.argv[1]](int(sys.argv[2]), random.Random(seed))
+
+
+if __name__ == "__main__":
+    main()
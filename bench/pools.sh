@@ -0,0 +1,36 @@
+#!/usr/bin/env bash
+
+# Usage: bench/pools.sh [scenario size]...
+# Times each scenario with orders and recipes carved from pools, then with
+# one system allocation each (-DUSE_POOLS=0), and reports instructions per
+# command when perf is available. Defaults to the scenarios that allocate
+# the most orders.
+
+set -e
+
+if [ $# -eq 0 ]; then
+  set -- orders 1000000 release 200000 manifest 1000000 runs 200000
+fi
+
+mkdir -p bench_traces
+while [ $# -ge 2 ]; do
+  trace=bench_traces/$1-$2.txt
+  if [ ! -f $trace ]; then
+    python3 bench/gen_trace.py $1 $2 > $trace
+  fi
+  n_commands=$(wc -l < $trace)
+
+  for pools in 1 0; do
+    make -s -B main CFLAGS="-Wall -Werror -std=gnu11 -O2 -DUSE_POOLS=$pools"
+    echo "Running $1 ($2) with USE_POOLS=$pools"
+    time ./main < $trace > /dev/null
+    if command -v perf > /dev/null; then
+      perf stat -x, -e instructions ./main < $trace 2>&1 > /dev/null |
+        awk -F, -v n=$n_commands \
+          '$1 ~ /^[0-9]+$/ { printf "%s per command: %.1f\n", $3, $1 / n }'
+    fi
+    echo -e "----------------------\n"
+  done
+  shift 2
+done
+make -s -B main
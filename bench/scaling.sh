@@ -0,0 +1,30 @@
+#!/usr/bin/env bash
+
+# Usage: bench/scaling.sh [size] [threads]
+# Times the rescan scenario with the woken buckets checked on 1 to `threads`
+# threads (default: every core), after the serial build.
+
+set -e
+
+size=${1:-100}
+max_threads=${2:-$(nproc)}
+trace=bench_traces/rescan-$size.txt
+
+mkdir -p bench_traces
+if [ ! -f $trace ]; then
+  python3 bench/gen_trace.py rescan $size > $trace
+fi
+
+for threads in serial $(seq 1 $max_threads); do
+  if [ $threads = serial ]; then
+    defines=
+    echo "Running rescan ($size) serially"
+  else
+    defines=-DPARALLEL_RESCAN=$threads
+    echo "Running rescan ($size) on $threads threads"
+  fi
+  make -s -B main CFLAGS="-Wall -Werror -std=gnu11 -O2 $defines"
+  time ./main < $trace > /dev/null
+  echo -e "----------------------\n"
+done
+make -s -B main
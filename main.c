@@ -1,189 +1,759 @@
+#include <limits.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#if PARALLEL_RESCAN > 0
+#include <pthread.h>
+#endif
+#if SPILL_RESIDENT_LIMIT > 0
+#include <unistd.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 // DEFINE ===========================================
-#define LINE_SIZE 512
-#define COMMAND_LEN 17
-#define HT_LOAD_FACTOR 0.90
+// Initial capacities, raised by the memory tier profiles of the Makefile so
+// that a run within them allocates nothing after startup. Every structure
+// still grows past its capacity.
+#ifndef LINE_SIZE
+#define LINE_SIZE 512 // Bytes of the line buffer
+#endif
+#ifndef HT_INIT_SIZE_RECIPE
 #define HT_INIT_SIZE_RECIPE 512
+#endif
+#ifndef HT_INIT_SIZE_INGREDIENT
 #define HT_INIT_SIZE_INGREDIENT 1024
+#endif
+#ifndef STOCK_INIT_IDS
+#define STOCK_INIT_IDS 1024
+#endif
+#ifndef POOL_INIT_ORDERS
+#define POOL_INIT_ORDERS 0 // Orders reserved in one block at startup
+#endif
+#ifndef POOL_INIT_RECIPES
+#define POOL_INIT_RECIPES 0
+#endif
+#ifndef WAITING_INDEX_INIT_SIZE
+#define WAITING_INDEX_INIT_SIZE 1024 // Power of two
+#endif
+#ifndef TRUCK_INIT_BLOCKS
+#define TRUCK_INIT_BLOCKS 4096 // Multiple of 64 * 64
+#endif
+#define COMMAND_LEN 17
+#define HT_LOAD_FACTOR 0.90
+#define STOCK_INIT_CAPACITY 4
+#define RECIPE_LANES 8 // Recipe arrays are padded to a multiple of this
+#define CACHE_LINE 64
+#define SIGNATURE_BITS 64 // Stock ID classes in a recipe's ingredient signature
+// Carve orders and recipes from page-sized chunks instead of one allocation
+// each (0 falls back to the system allocator)
+#ifndef USE_POOLS
+#define USE_POOLS 1
+#endif
+#define POOL_CHUNK_SIZE 4096
+#define ARENA_CHUNK_SIZE (1 << 20) // Bytes mapped at a time for names
+// Move the ingredients that block most often to the front of their recipes
+#ifndef ADAPTIVE_CHECK_ORDER
+#define ADAPTIVE_CHECK_ORDER 1
+#endif
+#define SHORTFALL_HALVING (1u << 16) // Shortfall count that halves them all
+// Orders between a waiting-order scan and its prefetches (0 disables them)
+#ifndef PREFETCH_DISTANCE
+#define PREFETCH_DISTANCE 4
+#endif
+#define WAITING_INIT_CAPACITY 8
+#define INDEX_FREE -1    // Arrival time of an unused entry
+#define INDEX_DELETED -2 // and of a deleted one
+// Waiting orders kept in memory before blocked buckets are moved to the spill
+// file (0 disables spilling), and the smallest bucket worth moving
+#ifndef SPILL_RESIDENT_LIMIT
+#define SPILL_RESIDENT_LIMIT 0
+#endif
+#ifndef SPILL_MIN_ORDERS
+#define SPILL_MIN_ORDERS 4096
+#endif
+// Bytes of the spill file slot holding a segment
+#define SPILL_SLOT_SIZE (SPILL_MIN_ORDERS * (long)sizeof(SpillRecord))
+#define TRUCK_BLOCK_BITS 6 // Blocks of 64 arrival times in the truck queue
+#define SCHEDULER_INIT_CAPACITY 16
+#define EVENT_DEPARTURE 0 // Kinds of timed events, handled in this order
+#define WATCH_NONE -2    // Recipe without waiting orders
+#define WATCH_PENDING -1 // Recipe to check again at the end of the restock
+// Threads checking the buckets woken by a restock at once (0 disables them)
+#ifndef PARALLEL_RESCAN
+#define PARALLEL_RESCAN 0
+#endif
+#ifndef PARALLEL_MIN_WOKEN
+#define PARALLEL_MIN_WOKEN 4096 // Fewer woken buckets are checked serially
+#endif
+#define CHECK_CACHED 0          // Outcomes of a recipe check, see RecipeCheck
+#define CHECK_SIGNATURE 1
+#define CHECK_SHORT 2
+#define CHECK_FIT 3
+#define CHECK_STALE 4
 // END DEFINE =======================================
 
 // GLOBAL VARIABLES =================================
 static int CURR_TIME = 0;
-static int TRUCK_TIME = 0;
-static int TRUCK_WEIGHT = 0;
+// Bumped by every restock: the blocked amounts of older epochs are stale
+static int RESTOCK_EPOCH = 0;
+// Allocators of the fixed-size objects
+static struct Pool *ORDER_POOL = NULL;
+static struct Pool *RECIPE_POOL = NULL;
+#ifdef DEBUG
+static long STATS_CHECKS = 0;               // Recipe checks against the levels
+static long STATS_INGREDIENTS_CHECKED = 0; // Ingredients read by them
+#endif
 // END GLOBAL VARIABLES =============================
 
-// RECIPE ==================
-typedef struct RecipeIngredient RecipeIngredient;
-RecipeIngredient *create_recipe_ingredient(char *, int);
-inline void free_recipe_ingredient(RecipeIngredient *);
+// POOL ==================
+typedef struct Pool Pool;
+Pool *create_pool(size_t, size_t, int);
+void free_pool(Pool *);
+bool pool_grow(Pool *);
+inline void *pool_at(const Pool *, int);
+inline int pool_alloc(Pool *);
+inline void pool_free(Pool *, int);
+#ifdef DEBUG
+void pool_report(const Pool *, const char *);
+#endif
+
+typedef struct ArenaChunk ArenaChunk;
+typedef struct Arena Arena;
+Arena *create_arena();
+void free_arena(Arena *);
+bool arena_grow(Arena *, size_t);
+inline void *arena_alloc(Arena *, size_t);
+inline void arena_release(Arena *, size_t);
+inline char *arena_strdup(Arena *, const char *);
+// END POOL ===========================
 
+// RECIPE ==================
 typedef struct Recipe Recipe;
-inline Recipe *create_recipe(char *);
-inline void free_recipe(Recipe *);
-inline void recipe_add_ingredient(Recipe *, RecipeIngredient *);
+typedef struct RecipeInfo RecipeInfo;
+inline Recipe *recipe_at(int);
+inline size_t recipe_info_size(const RecipeInfo *);
+inline Recipe *create_recipe(Arena *, char *);
+inline void free_recipe(Arena *, Recipe *);
+inline bool recipe_add_ingredient(Recipe *, int, int);
+int compare_ints(const void *, const void *);
 
 typedef struct RecipeHT RecipeHT;
+typedef struct RecipeCheck RecipeCheck;
 RecipeHT *create_recipe_ht(int);
 void free_recipe_ht(RecipeHT *);
 inline void recipe_ht_put(RecipeHT *, Recipe *);
+bool recipe_has_duplicates(RecipeHT *, Recipe *);
 inline Recipe *recipe_ht_get(RecipeHT *, char *);
 inline void recipe_ht_delete(RecipeHT *, char *);
 inline double recipe_ht_load_factor(RecipeHT *);
 void recipe_ht_resize(RecipeHT *);
+void recipe_ht_compact(RecipeHT *);
 // END RECIPE ===========================
 
 // STOCK ============================
-typedef struct StockIngredient StockIngredient;
 typedef struct Stock Stock; // of an ingredient
 typedef struct StockHT StockHT;
+typedef struct StockLot StockLot; // a parsed restock entry
+typedef struct StockLevel StockLevel;
 
-inline StockIngredient *create_stock_ingredient(int, int);
-inline void free_stock_ingredient(StockIngredient *);
-
-inline Stock *create_stock(char *);
+inline bool init_stock(Stock *, int);
 inline void free_stock(Stock *);
-inline void stock_add_ingredient(Stock *, StockIngredient *);
-inline void stock_remove_expired_ingredients(Stock *, int);
-inline void stock_remove_ingredient(Stock *, int);
+inline bool stock_reserve(Stock *, int);
+int stock_upper_bound(const int *, int, int, int);
+inline bool stock_add_ingredients(StockHT *, Stock *, StockLot *, int);
+int stock_find_cut(const int *, int, int, int *);
+inline void stock_remove_expired_ingredients(StockHT *, Stock *, int);
+inline void stock_remove_ingredient(StockHT *, Stock *, int);
 
 StockHT *create_stock_ht(int);
 void free_stock_ht(StockHT *);
-void stock_ht_put(StockHT *, Stock *);
+bool stock_ht_grow(StockHT *);
+bool stock_ht_reserve_lots(StockHT *, int);
+Stock *stock_ht_put(StockHT *, char *);
 inline Stock *stock_ht_get(StockHT *, char *);
 inline double stock_ht_load_factor(StockHT *);
 inline void stock_ht_resize(StockHT *);
 
 inline Stock *stock_get_or_create(StockHT *, char *);
+inline void stock_update_expiry(StockHT *, Stock *);
+inline void stock_track_empty(StockHT *, int, int);
+inline int recipe_first_missing(Recipe *, const StockLevel *, int, int, bool *);
 // END STOCK ============================
 
 // ORDER ===============================
 typedef struct Order Order;
-inline Order *create_order(Recipe *, int, int);
-inline void free_order(Order *);
-
-typedef struct OrderNode OrderNode;
-inline OrderNode *create_order_node(Order *);
-inline void free_order_node(OrderNode *);
-inline void order_node_enqueue_by_weight(OrderNode **, OrderNode *);
+inline Order *order_at(int);
+int create_order(Recipe *, int, int);
+inline void free_order(int);
+inline void order_enqueue_by_weight(int *, int);
 
 typedef struct OrderQueue OrderQueue;
 OrderQueue *create_order_queue();
 void free_order_queue(OrderQueue *);
-inline void order_queue_enqueue(OrderQueue *, OrderNode *);
-inline void order_queue_enqueue_by_arrival_time(OrderQueue *, OrderNode *);
-void order_queue_dequeue(OrderQueue *);
+bool order_queue_reserve(OrderQueue *, int);
+inline void order_queue_mark(OrderQueue *, int);
+inline void order_queue_unmark(OrderQueue *, int);
+inline int order_queue_prev_block(OrderQueue *, int);
+inline void order_queue_enqueue(OrderQueue *, int);
+inline int order_queue_enqueue_by_arrival_time(OrderQueue *, int, int);
+bool order_queue_reserve_load(OrderQueue *, int);
+void sort_truck_load(int *, int *, int);
+void order_queue_dequeue(OrderQueue *, int);
 // END ORDER ===========================
 
+// EVENT ===============================
+typedef struct Event Event;
+typedef struct Scheduler Scheduler;
+Scheduler *create_scheduler();
+void free_scheduler(Scheduler *);
+inline bool event_before(const Event *, const Event *);
+bool scheduler_push(Scheduler *, long, int, int);
+inline void scheduler_sift_down(Scheduler *, int);
+inline void scheduler_pop(Scheduler *);
+void scheduler_drop(Scheduler *, int);
+
+typedef struct Courier Courier;
+typedef struct Fleet Fleet;
+Fleet *create_fleet();
+void free_fleet(Fleet *);
+void fleet_clear(Fleet *, Scheduler *);
+bool fleet_add(Fleet *, Scheduler *, int, int);
+void fleet_depart(Fleet *, Scheduler *, OrderQueue *, const Event *);
+void fleet_repeat(Fleet *, OrderQueue *);
+
+inline void scheduler_run(Scheduler *, Fleet *, OrderQueue *);
+void scheduler_run_due(Scheduler *, Fleet *, OrderQueue *);
+// END EVENT ===========================
+
+// WAITING ===============================
+typedef struct WaitingBucket WaitingBucket;
+inline void init_waiting_bucket(WaitingBucket *);
+inline void free_waiting_bucket(WaitingBucket *);
+void waiting_bucket_compact(WaitingBucket *);
+bool waiting_bucket_reserve(WaitingBucket *);
+inline bool waiting_bucket_push(WaitingBucket *, int, int);
+inline int waiting_bucket_next_run(WaitingBucket *, int);
+inline void waiting_bucket_skip_cancelled(WaitingBucket *, int);
+bool waiting_bucket_cancel(WaitingBucket *, int);
+
+typedef struct WaitingQueue WaitingQueue;
+WaitingQueue *create_waiting_queue();
+void free_waiting_queue(WaitingQueue *);
+inline void recipe_watch(StockHT *, Recipe *, int);
+inline void recipe_unwatch(StockHT *, Recipe *);
+inline void waiting_queue_add(WaitingQueue *, StockHT *, Recipe *, int, int,
+                              int);
+typedef struct WaitingEntry WaitingEntry;
+inline WaitingEntry *waiting_index_get(WaitingQueue *, int);
+bool waiting_index_reserve(WaitingQueue *, int);
+void waiting_index_put(WaitingQueue *, int, Recipe *, int);
+inline void waiting_index_delete(WaitingQueue *, WaitingEntry *);
+void waiting_index_renumber(WaitingQueue *, Recipe *);
+bool waiting_queue_cancel(WaitingQueue *, StockHT *, int);
+typedef struct SpillSegment SpillSegment;
+typedef struct SpillRecord SpillRecord;
+long waiting_queue_claim_slot(WaitingQueue *);
+inline void waiting_queue_release_slot(WaitingQueue *, long);
+bool waiting_queue_write(WaitingQueue *, const SpillRecord *, int, long);
+bool waiting_queue_reserve_spill(WaitingQueue *, Recipe *, int);
+inline int spill_record_arrival(const SpillRecord *);
+bool waiting_queue_spill(WaitingQueue *, Recipe *);
+bool waiting_queue_defer(WaitingQueue *, Recipe *, int, int);
+bool waiting_queue_load(WaitingQueue *, Recipe *);
+void waiting_queue_unspill(WaitingQueue *, Recipe *);
+int waiting_queue_cancel_spilled(WaitingQueue *, int);
+inline void waiting_queue_relieve(WaitingQueue *, Recipe *);
+inline int waiting_heap_arrival(int);
+inline void waiting_queue_wake(WaitingQueue *, StockHT *, int);
+inline void waiting_queue_push_woken(WaitingQueue *, Recipe *);
+inline void waiting_queue_unwake(WaitingQueue *, Recipe *);
+inline void waiting_heap_sift_down(int *, int, int);
+void waiting_queue_record(WaitingQueue *, Recipe *);
+bool waiting_queue_speculate(WaitingQueue *, StockHT *);
+int waiting_queue_commit(WaitingQueue *, StockHT *, Recipe *, int);
+// END WAITING ===========================
+
 // UTIL =================================
 inline uint32_t fnv1a_hash_string(const char *, int);
-inline char *read_line(FILE *);
+inline char *read_line(FILE *, char **, size_t *);
 
-void add_recipe(RecipeHT *, char *);
+void add_recipe(RecipeHT *, StockHT *, char *);
 void remove_recipe(RecipeHT *, char *);
-void handle_stock(StockHT *, char *, OrderQueue *, OrderQueue *);
-void handle_order(RecipeHT *, StockHT *, OrderQueue *, OrderQueue *, char *);
-void handle_truck(char *);
-
-inline bool try_send_order(StockHT *, OrderQueue *, OrderQueue *, Order *, bool);
-bool check_missing_ingredients(StockHT *, Order *, Stock **);
-inline void check_waiting_orders(OrderQueue *, OrderQueue *, StockHT *);
-inline void send_order(StockHT *, Order *, bool, OrderQueue *, Stock **);
+int compare_stock_lots(const void *, const void *);
+void sort_stock_lots(StockLot *, int);
+void handle_stock(StockHT *, char *, WaitingQueue *, OrderQueue *);
+void handle_order(RecipeHT *, StockHT *, WaitingQueue *, OrderQueue *, char *);
+void handle_cancel(StockHT *, WaitingQueue *, char *);
+void handle_truck(Fleet *, Scheduler *, char *);
+
+inline bool try_send_order(WaitingQueue *, StockHT *, OrderQueue *, Recipe *,
+                           int, int);
+inline void recipe_check(const StockHT *, Recipe *, int, RecipeCheck *);
+inline int recipe_apply_check(StockHT *, Recipe *, int, const RecipeCheck *);
+int find_missing_ingredient(StockHT *, Recipe *, int);
+inline void recipe_set_blocked(Recipe *, int, int);
+inline void recipe_note_shortfall(StockHT *, Recipe *, int);
+inline void check_waiting_orders(WaitingQueue *, OrderQueue *, StockHT *);
+inline void send_order(StockHT *, Recipe *, int, int, OrderQueue *);
+int recipe_count_fits(StockHT *, Recipe *, int, int);
+int send_order_run(WaitingQueue *, StockHT *, Recipe *, int, int, OrderQueue *,
+                   int);
 // END UTIL =============================
 
-// ================== TODO CACHE ============================
-// This function are only used in the check_waiting_orders function
-typedef struct OrderCacheHT OrderCacheHT;
-double order_cache_ht_load_factor(OrderCacheHT *);
-OrderCacheHT *create_order_cache_ht(int);
-void order_cache_ht_add(OrderCacheHT *, OrderNode *);
-bool order_cache_ht_contains(OrderCacheHT *, OrderNode *);
-void order_cache_ht_resize(OrderCacheHT *);
-void free_order_cache_ht(OrderCacheHT *);
-// ================== END TODO CACHE ========================
-
-// RECIPE IMPLEMENTATION ============================
-struct RecipeIngredient {
-  char *name;
-  int quantity;
-  RecipeIngredient *next;
+// POOL IMPLEMENTATION ==============================
+// Objects of one fixed size, addressed by a 32-bit index instead of a
+// pointer: object i lives in chunk i >> shift, and a chunk holds about a
+// page of them. Freed objects are linked through their first int and handed
+// out again first; the chunks are only returned to the system when the pool
+// is freed. With USE_POOLS=0 each object is a chunk of its own, allocated
+// and freed on its own. Not thread-safe: only the main thread creates and
+// frees the objects.
+struct Pool {
+  size_t stride; // Object size, rounded up to the alignment
+  size_t alignment;
+  int shift;
+  int mask;      // (1 << shift) - 1
+  int free_list; // Index of the last freed object, -1 if none
+  int n_objects; // Indices handed out so far
+  char **chunks;
+  int n_chunks;
+  int chunks_capacity;
+  char *reserve; // Block holding the first n_reserved chunks
+  int n_reserved;
+#if !USE_POOLS
+  int *free_ids; // The freed objects' chunks are already freed
+  int n_free_ids;
+#endif
+#ifdef DEBUG
+  long n_allocs;
+  long n_frees;
+  long n_live;
+  long peak_live;
+#endif
 };
 
-struct Recipe {
-  char *name;
-  int weight;
-  int n_ingredients;
-  RecipeIngredient *ingredients; // TODO: Pointer to the stock ingredient
-  int n_waiting_orders;
-  Recipe *next;
+// Reserve room for `n_objects` objects at once when pools are used.
+Pool *create_pool(size_t size, size_t alignment, int n_objects) {
+  Pool *pool = (Pool *)malloc(sizeof(Pool));
+  if (pool == NULL) {
+    return NULL;
+  }
+
+  if (size < sizeof(int)) {
+    size = sizeof(int);
+  }
+  pool->stride = (size + alignment - 1) / alignment * alignment;
+  pool->alignment = alignment;
+  pool->shift = 0;
+#if USE_POOLS
+  while ((pool->stride << pool->shift) < POOL_CHUNK_SIZE) {
+    pool->shift++;
+  }
+#endif
+  pool->mask = (1 << pool->shift) - 1;
+  pool->free_list = -1;
+  pool->n_objects = 0;
+  pool->chunks = NULL;
+  pool->n_chunks = 0;
+  pool->chunks_capacity = 0;
+  pool->reserve = NULL;
+  pool->n_reserved = 0;
+#if !USE_POOLS
+  pool->free_ids = NULL;
+  pool->n_free_ids = 0;
+#endif
+#ifdef DEBUG
+  pool->n_allocs = 0;
+  pool->n_frees = 0;
+  pool->n_live = 0;
+  pool->peak_live = 0;
+#endif
+
+#if USE_POOLS
+  // Its pages are only touched as the objects are handed out. Without it,
+  // the pool just grows from the first allocation.
+  int n_chunks = (n_objects + pool->mask) >> pool->shift;
+  size_t chunk_size = pool->stride << pool->shift;
+  if (n_chunks > 0) {
+    pool->chunks = (char **)malloc(n_chunks * sizeof(char *));
+    pool->reserve = (char *)aligned_alloc(alignment, n_chunks * chunk_size);
+    if (pool->chunks == NULL || pool->reserve == NULL) {
+      free(pool->chunks);
+      free(pool->reserve);
+      pool->chunks = NULL;
+      pool->reserve = NULL;
+    } else {
+      for (int i = 0; i < n_chunks; i++) {
+        pool->chunks[i] = pool->reserve + i * chunk_size;
+      }
+      pool->n_chunks = n_chunks;
+      pool->chunks_capacity = n_chunks;
+      pool->n_reserved = n_chunks;
+    }
+  }
+#else
+  (void)n_objects;
+#endif
+  return pool;
+}
+
+void free_pool(Pool *pool) {
+  for (int i = pool->n_reserved; i < pool->n_chunks; i++) {
+    free(pool->chunks[i]);
+  }
+  free(pool->reserve);
+  free(pool->chunks);
+#if !USE_POOLS
+  free(pool->free_ids);
+#endif
+  free(pool);
+}
+
+// Add a chunk for the next objects. Returns false if it cannot.
+bool pool_grow(Pool *pool) {
+  if (pool->n_chunks == pool->chunks_capacity) {
+    int new_capacity =
+        pool->chunks_capacity == 0 ? 16 : 2 * pool->chunks_capacity;
+    char **chunks =
+        (char **)realloc(pool->chunks, new_capacity * sizeof(char *));
+    if (chunks == NULL) {
+      return false;
+    }
+    pool->chunks = chunks;
+#if !USE_POOLS
+    int *free_ids =
+        (int *)realloc(pool->free_ids, new_capacity * sizeof(int));
+    if (free_ids == NULL) {
+      return false;
+    }
+    pool->free_ids = free_ids;
+#endif
+    // Only once every array has grown
+    pool->chunks_capacity = new_capacity;
+  }
+
+  char *chunk =
+      (char *)aligned_alloc(pool->alignment, pool->stride << pool->shift);
+  if (chunk == NULL) {
+    return false;
+  }
+  pool->chunks[pool->n_chunks++] = chunk;
+  return true;
+}
+
+void *pool_at(const Pool *pool, int id) {
+  return pool->chunks[id >> pool->shift] +
+         (size_t)(id & pool->mask) * pool->stride;
+}
+
+// Return the index of a new object, or -1 if there is no room for it.
+int pool_alloc(Pool *pool) {
+  int id;
+#if USE_POOLS
+  if (pool->free_list != -1) {
+    id = pool->free_list;
+    pool->free_list = *(int *)pool_at(pool, id);
+  } else {
+    if ((pool->n_objects >> pool->shift) == pool->n_chunks &&
+        !pool_grow(pool)) {
+      return -1;
+    }
+    id = pool->n_objects++;
+  }
+#else
+  if (pool->n_free_ids > 0) {
+    id = pool->free_ids[pool->n_free_ids - 1];
+    pool->chunks[id] = (char *)aligned_alloc(pool->alignment, pool->stride);
+    if (pool->chunks[id] == NULL) {
+      return -1;
+    }
+    pool->n_free_ids--;
+  } else {
+    if (!pool_grow(pool)) {
+      return -1;
+    }
+    id = pool->n_objects++;
+  }
+#endif
+#ifdef DEBUG
+  pool->n_allocs++;
+  if (++pool->n_live > pool->peak_live) {
+    pool->peak_live = pool->n_live;
+  }
+#endif
+  return id;
+}
+
+void pool_free(Pool *pool, int id) {
+#ifdef DEBUG
+  pool->n_frees++;
+  pool->n_live--;
+#endif
+#if USE_POOLS
+  *(int *)pool_at(pool, id) = pool->free_list;
+  pool->free_list = id;
+#else
+  free(pool->chunks[id]);
+  pool->chunks[id] = NULL;
+  pool->free_ids[pool->n_free_ids++] = id;
+#endif
+}
+
+#ifdef DEBUG
+void pool_report(const Pool *pool, const char *name) {
+  fprintf(stderr,
+          "%s pool: %ld allocations, %ld frees, %ld live at peak, %d chunks "
+          "of %zu-byte objects\n",
+          name, pool->n_allocs, pool->n_frees, pool->peak_live, pool->n_chunks,
+          pool->stride);
+}
+#endif
+
+// Names carved one after the other from large anonymous mappings. Nothing is
+// freed on its own: released bytes are only counted, so that their owner can
+// copy what is still live to a new arena once enough of them are dead, and
+// the whole arena is unmapped at once.
+struct ArenaChunk {
+  char *base;
+  size_t size;
 };
 
-struct RecipeHT {
-  int n_elements;
-  int size; // Number of buckets
-  Recipe **recipes;
+struct Arena {
+  ArenaChunk *chunks;
+  int n_chunks;
+  int chunks_capacity;
+  char *next; // Unused part of the newest chunk
+  char *end;
+  size_t used; // Bytes handed out
+  size_t dead; // Of them, released
 };
 
-RecipeIngredient *create_recipe_ingredient(char *name, int quantity) {
-  RecipeIngredient *ingredient =
-      (RecipeIngredient *)malloc(sizeof(RecipeIngredient));
-  if (ingredient == NULL) {
+Arena *create_arena() {
+  Arena *arena = (Arena *)malloc(sizeof(Arena));
+  if (arena == NULL) {
     return NULL;
   }
 
-  ingredient->name = (char *)malloc(strlen(name) + 1);
-  if (ingredient->name == NULL) {
-    free(ingredient);
-    return NULL;
+  arena->chunks = NULL;
+  arena->n_chunks = 0;
+  arena->chunks_capacity = 0;
+  arena->next = NULL;
+  arena->end = NULL;
+  arena->used = 0;
+  arena->dead = 0;
+  return arena;
+}
+
+void free_arena(Arena *arena) {
+  for (int i = 0; i < arena->n_chunks; i++) {
+    munmap(arena->chunks[i].base, arena->chunks[i].size);
+  }
+  free(arena->chunks);
+  free(arena);
+}
+
+// Map a chunk with room for at least `size` bytes and carve from it from now
+// on. Returns false if it cannot.
+bool arena_grow(Arena *arena, size_t size) {
+  if (arena->n_chunks == arena->chunks_capacity) {
+    int new_capacity =
+        arena->chunks_capacity == 0 ? 8 : 2 * arena->chunks_capacity;
+    ArenaChunk *chunks = (ArenaChunk *)realloc(
+        arena->chunks, new_capacity * sizeof(ArenaChunk));
+    if (chunks == NULL) {
+      return false;
+    }
+    arena->chunks = chunks;
+    arena->chunks_capacity = new_capacity;
   }
 
-  strcpy(ingredient->name, name);
-  ingredient->quantity = quantity;
-  ingredient->next = NULL;
+  size_t chunk_size = ARENA_CHUNK_SIZE;
+  if (chunk_size < size) {
+    chunk_size =
+        (size + ARENA_CHUNK_SIZE - 1) / ARENA_CHUNK_SIZE * ARENA_CHUNK_SIZE;
+  }
+  char *base = (char *)mmap(NULL, chunk_size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED) {
+    return false;
+  }
+  arena->chunks[arena->n_chunks].base = base;
+  arena->chunks[arena->n_chunks].size = chunk_size;
+  arena->n_chunks++;
+  arena->next = base;
+  arena->end = base + chunk_size;
+  return true;
+}
+
+// Sizes are rounded up to a pointer, so that every block stays aligned.
+void *arena_alloc(Arena *arena, size_t size) {
+  size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+  if ((size_t)(arena->end - arena->next) < size && !arena_grow(arena, size)) {
+    return NULL;
+  }
+  void *block = arena->next;
+  arena->next += size;
+  arena->used += size;
+  return block;
+}
 
-  return ingredient;
+void arena_release(Arena *arena, size_t size) {
+  arena->dead += (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
 }
 
-void free_recipe_ingredient(RecipeIngredient *ingredient) {
-  while (ingredient != NULL) {
-    RecipeIngredient *next = ingredient->next;
-    free(ingredient->name);
-    free(ingredient);
-    ingredient = next;
+char *arena_strdup(Arena *arena, const char *str) {
+  size_t size = strlen(str) + 1;
+  char *copy = (char *)arena_alloc(arena, size);
+  if (copy != NULL) {
+    memcpy(copy, str, size);
   }
+  return copy;
 }
+// END POOL IMPLEMENTATION ==========================
 
-inline Recipe *create_recipe(char *name) {
-  Recipe *recipe = (Recipe *)malloc(sizeof(Recipe));
-  if (recipe == NULL) {
+// RECIPE IMPLEMENTATION ============================
+// Waiting orders of a recipe as parallel arrays. Consecutive orders for the
+// same amount form a run: run r waits for run_amounts[r] units and holds the
+// arrival times arrivals[run_firsts[r], run_ends[r]). Orders only leave a run
+// from its front, by moving run_firsts[r]; emptied runs and sent arrival
+// times stay in place as tombstones until the arrays are full and at least
+// half dead, and are then compacted in place. So do cancelled orders, which
+// are also flagged in `cancelled` and skipped when they reach a run's head.
+struct WaitingBucket {
+  int *arrivals;
+  bool *cancelled; // Parallel to arrivals, NULL until an order is cancelled
+  int n_arrivals;
+  int arrivals_capacity;
+  int n_live; // Orders still waiting
+  // run_amounts, run_firsts and run_ends share one allocation
+  int *run_amounts;
+  int *run_firsts;
+  int *run_ends;
+  int first_run; // Runs before it are empty
+  int n_runs;
+  int n_live_runs;
+  int runs_capacity;
+  // Orders moved out of memory, all newer than the ones above except the
+  // first `n_scanned` segments, already scanned by the running restock: the
+  // spill file segments in arrival order, then the orders not written yet
+  SpillSegment *segments;
+  int n_segments;
+  int segments_capacity;
+  int n_scanned;
+  SpillRecord *pending; // SPILL_MIN_ORDERS long
+  int n_pending;
+  int n_spilled;   // Spilled orders still waiting
+  int spilled_pos; // In the WaitingQueue's spilled recipes
+};
+
+// Hot part of a recipe: everything an order check reads shares one cache
+// line. The name and the hash chain live in the RecipeInfo side table.
+struct Recipe {
+  _Alignas(CACHE_LINE) int weight;
+  int n_ingredients;
+  int n_waiting_orders;
+  int id; // Index in RECIPE_POOL
+  // Parallel arrays: stock ID and quantity of each ingredient, padded with
+  // zero quantities up to a multiple of RECIPE_LANES. Both live in a single
+  // allocation, so a small recipe's ingredients take a single cache line.
+  int *ingredient_ids;
+  int *quantities;
+  RecipeInfo *info;
+  // Smallest amount found short during RESTOCK_EPOCH and the stock ID that
+  // blocked it. Until the next restock the totals can only go down, so any
+  // order of the recipe for at least that amount is blocked by the same stock.
+  int blocked_epoch;
+  int blocked_amount;
+  int blocked_id;
+  // Bit id % SIGNATURE_BITS is set for the ID of every ingredient needed
+  uint64_t signature;
+
+  // Waiting orders of the recipe, in arrival order, and a lower bound on
+  // their amounts. The bucket is blocked as a whole by the stock that blocks
+  // its smallest amount, so it is the bucket that watches that stock.
+  WaitingBucket waiting;
+  int min_amount;
+  int watching; // Stock ID, WATCH_PENDING or WATCH_NONE
+  int watch_prev; // Recipe IDs, -1 at the ends of the list
+  int watch_next;
+  // State of the bucket during check_waiting_orders
+  int cursor; // Run to check next
+  int scan_min;
+};
+
+// Cold part of a recipe, chained in the RecipeHT buckets.
+struct RecipeInfo {
+  RecipeInfo *next;
+  Recipe *recipe;
+  int capacity; // Allocated ingredient slots
+  bool has_duplicates; // Some ingredient is listed more than once
+  char name[];
+};
+
+struct RecipeHT {
+  int n_elements;
+  int size; // Number of buckets
+  RecipeInfo **recipes;
+  Arena *arena; // Holds the RecipeInfos, names included
+  // Scratch array of recipe_has_duplicates, kept from one recipe to the next
+  int *sorted_ids;
+  int sorted_ids_capacity;
+};
+
+size_t recipe_info_size(const RecipeInfo *info) {
+  return sizeof(RecipeInfo) + strlen(info->name) + 1;
+}
+
+Recipe *recipe_at(int id) { return (Recipe *)pool_at(RECIPE_POOL, id); }
+
+Recipe *create_recipe(Arena *arena, char *name) {
+  int id = pool_alloc(RECIPE_POOL);
+  if (id == -1) {
     return NULL;
   }
+  Recipe *recipe = recipe_at(id);
 
-  recipe->name = (char *)malloc(strlen(name) + 1);
-  if (recipe->name == NULL) {
-    free(recipe);
+  RecipeInfo *info =
+      (RecipeInfo *)arena_alloc(arena, sizeof(RecipeInfo) + strlen(name) + 1);
+  if (info == NULL) {
+    pool_free(RECIPE_POOL, id);
     return NULL;
   }
 
-  strcpy(recipe->name, name);
+  strcpy(info->name, name);
+  info->capacity = 0;
+  info->has_duplicates = false;
+  info->recipe = recipe;
+  info->next = NULL;
+
   recipe->weight = 0;
   recipe->n_ingredients = 0;
-  recipe->ingredients = NULL;
-  recipe->next = NULL;
   recipe->n_waiting_orders = 0;
+  recipe->id = id;
+  recipe->ingredient_ids = NULL;
+  recipe->quantities = NULL;
+  recipe->info = info;
+  recipe->blocked_epoch = -1;
+  recipe->signature = 0;
+  init_waiting_bucket(&recipe->waiting);
+  recipe->min_amount = INT_MAX;
+  recipe->watching = WATCH_NONE;
 
   return recipe;
 }
 
-inline void free_recipe(Recipe *recipe) {
-  free_recipe_ingredient(recipe->ingredients);
-  free(recipe->name);
-  free(recipe);
+void free_recipe(Arena *arena, Recipe *recipe) {
+  free(recipe->ingredient_ids);
+  free_waiting_bucket(&recipe->waiting);
+  arena_release(arena, recipe_info_size(recipe->info));
+  pool_free(RECIPE_POOL, recipe->id);
 }
 
 RecipeHT *create_recipe_ht(int size) {
@@ -194,68 +764,121 @@ RecipeHT *create_recipe_ht(int size) {
 
   ht->n_elements = 0;
   ht->size = size;
-  ht->recipes = (Recipe **)malloc(size * sizeof(Recipe *));
-  if (ht->recipes == NULL) {
+  ht->recipes = (RecipeInfo **)malloc(size * sizeof(RecipeInfo *));
+  ht->arena = create_arena();
+  if (ht->recipes == NULL || ht->arena == NULL) {
     return NULL;
   }
   for (int i = 0; i < size; i++) {
     ht->recipes[i] = NULL;
   }
+  ht->sorted_ids = NULL;
+  ht->sorted_ids_capacity = 0;
 
   return ht;
 }
 
 void free_recipe_ht(RecipeHT *ht) {
   for (int i = 0; i < ht->size; i++) {
-    Recipe *recipe = ht->recipes[i];
-    while (recipe != NULL) {
-      Recipe *next = recipe->next;
-      free_recipe(recipe);
-      recipe = next;
+    RecipeInfo *info = ht->recipes[i];
+    while (info != NULL) {
+      RecipeInfo *next = info->next;
+      free_recipe(ht->arena, info->recipe);
+      info = next;
     }
   }
 
   free(ht->recipes);
+  free(ht->sorted_ids);
+  free_arena(ht->arena);
   free(ht);
 }
 
-inline void recipe_add_ingredient(Recipe *recipe,
-                                  RecipeIngredient *ingredient) {
-  recipe->weight += ingredient->quantity;
+// Append an ingredient. Returns false, leaving the recipe as it was, if there
+// is no room for it.
+bool recipe_add_ingredient(Recipe *recipe, int id, int quantity) {
+  RecipeInfo *info = recipe->info;
+  if (recipe->n_ingredients == info->capacity) {
+    int old_capacity = info->capacity;
+    int *ids = (int *)realloc(recipe->ingredient_ids,
+                              2 * (old_capacity + RECIPE_LANES) * sizeof(int));
+    if (ids == NULL) {
+      return false;
+    }
+    info->capacity += RECIPE_LANES;
+    recipe->ingredient_ids = ids;
+    recipe->quantities = recipe->ingredient_ids + info->capacity;
+    memmove(recipe->quantities, recipe->ingredient_ids + old_capacity,
+            old_capacity * sizeof(int));
+    for (int i = recipe->n_ingredients; i < info->capacity; i++) {
+      recipe->ingredient_ids[i] = id;
+      recipe->quantities[i] = 0;
+    }
+  }
+
+  recipe->ingredient_ids[recipe->n_ingredients] = id;
+  recipe->quantities[recipe->n_ingredients] = quantity;
+  if (quantity > 0) {
+    recipe->signature |= 1ULL << (id % SIGNATURE_BITS);
+  }
   recipe->n_ingredients++;
-  ingredient->next = recipe->ingredients;
-  recipe->ingredients = ingredient;
+  recipe->weight += quantity;
+  return true;
 }
 
-inline Recipe *recipe_ht_get(RecipeHT *ht, char *name) {
-  uint32_t hash = fnv1a_hash_string(name, ht->size);
-  Recipe *recipe = ht->recipes[hash];
+int compare_ints(const void *a, const void *b) {
+  return *(const int *)a - *(const int *)b;
+}
 
-  if (recipe == NULL) {
-    return NULL;
+// Sort a copy of the ingredient IDs in the table's scratch array. Returns
+// true, the safe answer, if the array cannot grow.
+bool recipe_has_duplicates(RecipeHT *ht, Recipe *recipe) {
+  int n = recipe->n_ingredients;
+  if (n < 2) {
+    return false;
   }
+  if (n > ht->sorted_ids_capacity) {
+    int capacity = ht->sorted_ids_capacity == 0 ? 16 : ht->sorted_ids_capacity;
+    while (capacity < n) {
+      capacity *= 2;
+    }
+    int *sorted_ids = (int *)realloc(ht->sorted_ids, capacity * sizeof(int));
+    if (sorted_ids == NULL) {
+      return true;
+    }
+    ht->sorted_ids = sorted_ids;
+    ht->sorted_ids_capacity = capacity;
+  }
+  int *ids = ht->sorted_ids;
+  memcpy(ids, recipe->ingredient_ids, n * sizeof(int));
+  qsort(ids, n, sizeof(int), compare_ints);
+
+  bool duplicates = false;
+  for (int i = 1; i < n && !duplicates; i++) {
+    duplicates = ids[i] == ids[i - 1];
+  }
+  return duplicates;
+}
+
+inline Recipe *recipe_ht_get(RecipeHT *ht, char *name) {
+  uint32_t hash = fnv1a_hash_string(name, ht->size);
+  RecipeInfo *info = ht->recipes[hash];
 
-  while (recipe != NULL) {
-    if (strcmp(recipe->name, name) == 0) {
-      return recipe;
+  while (info != NULL) {
+    if (strcmp(info->name, name) == 0) {
+      return info->recipe;
     }
-    recipe = recipe->next;
+    info = info->next;
   }
 
   return NULL;
 }
 
 inline void recipe_ht_put(RecipeHT *ht, Recipe *recipe) {
-  uint32_t hash = fnv1a_hash_string(recipe->name, ht->size);
-  Recipe *curr_recipe = ht->recipes[hash];
-
-  if (curr_recipe == NULL) {
-    ht->recipes[hash] = recipe;
-    ht->n_elements++;
-    return;
-  }
-  recipe->next = curr_recipe;
-  ht->recipes[hash] = recipe;
+  RecipeInfo *info = recipe->info;
+  uint32_t hash = fnv1a_hash_string(info->name, ht->size);
+  info->next = ht->recipes[hash];
+  ht->recipes[hash] = info;
   ht->n_elements++;
 
   if (recipe_ht_load_factor(ht) >= HT_LOAD_FACTOR) {
@@ -265,41 +888,36 @@ inline void recipe_ht_put(RecipeHT *ht, Recipe *recipe) {
 
 void recipe_ht_delete(RecipeHT *ht, char *name) {
   uint32_t hash = fnv1a_hash_string(name, ht->size);
-  Recipe *curr_recipe = ht->recipes[hash];
-
-  if (curr_recipe == NULL) {
-    printf("non presente\n");
-    return;
-  }
-  // printf("curr_recipe->n_waiting_orders: %d\n",
-  // curr_recipe->n_waiting_orders);
-
-  Recipe *prev_recipe = NULL;
+  RecipeInfo *curr_info = ht->recipes[hash];
+  RecipeInfo *prev_info = NULL;
 
-  while (curr_recipe != NULL && strcmp(curr_recipe->name, name) != 0) {
-    prev_recipe = curr_recipe;
-    curr_recipe = curr_recipe->next;
+  while (curr_info != NULL && strcmp(curr_info->name, name) != 0) {
+    prev_info = curr_info;
+    curr_info = curr_info->next;
   }
 
-  if (curr_recipe == NULL) {
+  if (curr_info == NULL) {
     printf("non presente\n");
     return;
   }
 
   // Check if there are waiting orders with this recipe
-  if (curr_recipe->n_waiting_orders > 0) {
+  if (curr_info->recipe->n_waiting_orders > 0) {
     printf("ordini in sospeso\n");
     return;
   }
 
-  if (prev_recipe == NULL)
-    ht->recipes[hash] = curr_recipe->next;
+  if (prev_info == NULL)
+    ht->recipes[hash] = curr_info->next;
   else
-    prev_recipe->next = curr_recipe->next;
+    prev_info->next = curr_info->next;
 
-  curr_recipe->next = NULL;
-  free_recipe(curr_recipe);
+  free_recipe(ht->arena, curr_info->recipe);
   ht->n_elements--;
+  if (ht->arena->dead > ARENA_CHUNK_SIZE &&
+      ht->arena->dead > ht->arena->used / 2) {
+    recipe_ht_compact(ht);
+  }
 
   printf("rimossa\n");
 }
@@ -309,178 +927,387 @@ inline double recipe_ht_load_factor(RecipeHT *ht) {
 }
 
 void recipe_ht_resize(RecipeHT *ht) {
-  RecipeHT *new_ht = create_recipe_ht(ht->size * 2);
+  int new_size = ht->size * 2;
+  RecipeInfo **new_recipes =
+      (RecipeInfo **)malloc(new_size * sizeof(RecipeInfo *));
+  for (int i = 0; i < new_size; i++) {
+    new_recipes[i] = NULL;
+  }
 
   for (int i = 0; i < ht->size; i++) {
-    Recipe *recipe = ht->recipes[i];
-    while (recipe != NULL) {
-      Recipe *next = recipe->next;
-      recipe->next = NULL;
-      recipe_ht_put(new_ht, recipe);
-      recipe = next;
+    RecipeInfo *info = ht->recipes[i];
+    while (info != NULL) {
+      RecipeInfo *next = info->next;
+      uint32_t hash = fnv1a_hash_string(info->name, new_size);
+      info->next = new_recipes[hash];
+      new_recipes[hash] = info;
+      info = next;
     }
   }
 
   free(ht->recipes);
-  ht->recipes = new_ht->recipes;
-  ht->size = new_ht->size;
-  ht->n_elements = new_ht->n_elements;
-  free(new_ht);
+  ht->recipes = new_recipes;
+  ht->size = new_size;
+}
+
+// Copy the live RecipeInfos to a new arena, in a single chunk, and unmap the
+// old one with the removed recipes' infos. Nothing changes if the new chunk
+// cannot be mapped.
+void recipe_ht_compact(RecipeHT *ht) {
+  Arena *arena = create_arena();
+  if (arena == NULL) {
+    return;
+  }
+  if (!arena_grow(arena, ht->arena->used - ht->arena->dead)) {
+    free_arena(arena);
+    return;
+  }
+
+  for (int i = 0; i < ht->size; i++) {
+    RecipeInfo **link = &ht->recipes[i];
+    while (*link != NULL) {
+      size_t size = recipe_info_size(*link);
+      RecipeInfo *info = (RecipeInfo *)arena_alloc(arena, size);
+      memcpy(info, *link, size);
+      info->recipe->info = info;
+      *link = info;
+      link = &info->next;
+    }
+  }
+
+  free_arena(ht->arena);
+  ht->arena = arena;
 }
 
+// Outcome of checking `amount` units of a recipe, before anything is changed
+struct RecipeCheck {
+  int kind;  // CHECK_*
+  int index; // Of the ingredient found short, for the signature and the levels
+};
 // END RECIPE IMPLEMENTATION =========================
 
 // STOCK IMPLEMENTATION ============================
-struct StockIngredient {
+// Hot part of an ingredient's stock. Stocks are stored by value in a dense,
+// cache-line-aligned array indexed by ID, two per line; the name and the hash
+// chain live in StockHT side tables.
+struct Stock {
+  _Alignas(CACHE_LINE / 2) int id; // Index in the dense StockHT arrays
+  // Lots are stored contiguously, sorted by expiration date. The live lots
+  // are in [first_lot, first_lot + n_lots): consuming or expiring the oldest
+  // lots only moves first_lot forward.
+  int first_lot;
+  int n_lots;
+  int capacity;
+  int *quantities;
+  int *expiration_dates;
+};
+
+struct StockLot {
+  char *name;
   int quantity;
   int expiration_date;
-  StockIngredient *next;
 };
 
-struct Stock {
-  char *name;
-  int n_ingredients; // TODO: Evaluate to remove
-  int total_quantity;
-  StockIngredient *ingredients;
-  Stock *next;
+// Order-path view of a stock: its live total and the expiration date of its
+// oldest lot (INT_MAX if none), side by side so that checking an ingredient
+// costs a single cache miss.
+struct StockLevel {
+  int total;
+  int next_expiry;
 };
 
 struct StockHT {
-  int n_elements;
-  int size; // Number of buckets
-  Stock **stocks;
+  int size;     // Number of buckets
+  int *buckets; // ID of the first stock of each bucket, -1 if empty
+  // Dense arrays indexed by stock ID: every ingredient ever named gets an ID.
+  int n_ids;
+  int ids_capacity;
+  Stock *stocks;
+  StockLevel *levels;
+  // Cold side tables, only used to find a stock by name.
+  char **names; // In the arena
+  Arena *arena;
+  int *chain; // Next ID in the same bucket, -1 at the end
+  // Recipes whose waiting orders are blocked by each stock, linked through
+  // watch_next. An order can only become feasible once the stock that
+  // blocked it is restocked, since consuming and expiring lots only lower
+  // the totals.
+  int *watchers; // Recipe IDs, -1 if none
+  // Bit b is set when every stock whose ID is b modulo SIGNATURE_BITS is
+  // empty, so a recipe whose signature meets it is short of something.
+  uint64_t empty_mask;
+  int nonempty_count[SIGNATURE_BITS];
+  // Number of times each stock was found short by a recipe check, all halved
+  // whenever one reaches SHORTFALL_HALVING
+  unsigned *shortfalls;
+  // Scratch arrays of handle_stock, kept from one restock to the next
+  StockLot *lots;
+  int *lot_table;
+  int lots_capacity;
 };
 
-inline StockIngredient *create_stock_ingredient(int quantity, int expiration_date) {
-  StockIngredient *ingredient =
-      (StockIngredient *)malloc(sizeof(StockIngredient));
-  if (ingredient == NULL) {
-    printf("Error while allocating StockIngredient\n");
-    return NULL;
+inline bool init_stock(Stock *stock, int id) {
+  stock->id = id;
+  stock->first_lot = 0;
+  stock->n_lots = 0;
+  stock->capacity = STOCK_INIT_CAPACITY;
+  stock->quantities = (int *)malloc(stock->capacity * sizeof(int));
+  stock->expiration_dates = (int *)malloc(stock->capacity * sizeof(int));
+  if (stock->quantities == NULL || stock->expiration_dates == NULL) {
+    free(stock->quantities);
+    free(stock->expiration_dates);
+    return false;
   }
 
-  ingredient->quantity = quantity;
-  ingredient->expiration_date = expiration_date;
-  ingredient->next = NULL;
+  return true;
+}
 
-  return ingredient;
+// Keep the stock level's next_expiry in sync with the oldest live lot.
+void stock_update_expiry(StockHT *ht, Stock *stock) {
+  ht->levels[stock->id].next_expiry =
+      stock->n_lots > 0 ? stock->expiration_dates[stock->first_lot] : INT_MAX;
 }
 
-inline void free_stock_ingredient(StockIngredient *ingredient) {
-  while (ingredient != NULL) {
-    StockIngredient *next = ingredient->next;
-    free(ingredient);
-    ingredient = next;
+// Keep the empty mask in sync when a stock's total moves to or from zero.
+void stock_track_empty(StockHT *ht, int id, int old_total) {
+  int total = ht->levels[id].total;
+  if ((old_total == 0) == (total == 0)) {
+    return;
+  }
+
+  int bit = id % SIGNATURE_BITS;
+  if (total == 0) {
+    if (--ht->nonempty_count[bit] == 0) {
+      ht->empty_mask |= 1ULL << bit;
+    }
+  } else if (ht->nonempty_count[bit]++ == 0) {
+    ht->empty_mask &= ~(1ULL << bit);
   }
 }
 
-inline void stock_add_ingredient(Stock *stock, StockIngredient *ingredient) {
-  stock->total_quantity += ingredient->quantity;
-
-  if (stock->ingredients == NULL) {
-    stock->ingredients = ingredient;
-    ingredient->next = NULL;
-    stock->n_ingredients++;
-    return;
+// Make room for `n_extra` more lots at the end of the live range. The live
+// lots are slid back to the start of the arrays, and the arrays are doubled
+// until they are at most half full, so both moves amortize to O(1) per lot.
+bool stock_reserve(Stock *stock, int n_extra) {
+  int needed = stock->n_lots + n_extra;
+  if (stock->first_lot + needed <= stock->capacity) {
+    return true;
   }
 
-  StockIngredient *curr_ingredient = stock->ingredients;
-  StockIngredient *prev_ingredient = NULL;
-  while (curr_ingredient != NULL &&
-         curr_ingredient->expiration_date < ingredient->expiration_date) {
-    prev_ingredient = curr_ingredient;
-    curr_ingredient = curr_ingredient->next;
+  if (stock->first_lot > 0) {
+    memmove(stock->quantities, stock->quantities + stock->first_lot,
+            stock->n_lots * sizeof(int));
+    memmove(stock->expiration_dates,
+            stock->expiration_dates + stock->first_lot,
+            stock->n_lots * sizeof(int));
+    stock->first_lot = 0;
   }
 
-  if (prev_ingredient == NULL) {
-    ingredient->next = stock->ingredients;
-    stock->ingredients = ingredient;
-    stock->n_ingredients++;
-    return;
+  if (needed <= stock->capacity / 2) {
+    return true;
   }
-  if (curr_ingredient != NULL &&
-      curr_ingredient->expiration_date == ingredient->expiration_date) {
-    curr_ingredient->quantity += ingredient->quantity;
-    free(ingredient);
-    return;
+  int capacity = stock->capacity;
+  while (needed > capacity / 2) {
+    capacity *= 2;
+  }
+  int *quantities = (int *)realloc(stock->quantities, capacity * sizeof(int));
+  if (quantities == NULL) {
+    return false;
+  }
+  stock->quantities = quantities;
+  int *dates = (int *)realloc(stock->expiration_dates, capacity * sizeof(int));
+  if (dates == NULL) {
+    return false;
+  }
+  stock->expiration_dates = dates;
+  stock->capacity = capacity;
+  return true;
+}
+
+// Return the index of the first lot in [low, high) expiring after `date`.
+// The loop has no data-dependent branch (the compiler emits a cmov), which
+// matters when new lots land at unpredictable positions.
+int stock_upper_bound(const int *dates, int low, int high, int date) {
+  int n = high - low;
+  if (n <= 0) {
+    return low;
   }
 
-  prev_ingredient->next = ingredient;
-  ingredient->next = curr_ingredient;
-  stock->n_ingredients++;
+  const int *base = dates + low;
+  while (n > 1) {
+    int half = n / 2;
+    base = base[half] <= date ? base + half : base;
+    n -= half;
+  }
+  return (int)(base - dates) + (*base <= date);
 }
 
-inline Stock *create_stock(char *name) {
-  Stock *stock = (Stock *)malloc(sizeof(Stock));
-  if (stock == NULL) {
-    return NULL;
+// Merge `n` new lots, sorted by expiration date, into the stock in a single
+// backward pass that moves existing lots in blocks. Lots with the same
+// expiration date are coalesced. In the usual case every new lot expires after
+// the existing ones, nothing moves and the new lots are simply appended.
+// Returns false, leaving the stock as it was, if there is no room for them.
+bool stock_add_ingredients(StockHT *ht, Stock *stock, StockLot *lots, int n) {
+  // For each new lot, find (relative to first_lot) the first existing lot
+  // expiring after it, and count the lots the merge will really add so that
+  // every lot can be written straight to its final slot.
+  int old_total = ht->levels[stock->id].total;
+  // In the grouping table of handle_stock, done with by now and larger than
+  // the lots of the whole line: a line has no bound on its length
+  int *positions = ht->lot_table;
+  int n_added = 0;
+  int *dates = stock->expiration_dates + stock->first_lot;
+  int low = 0;
+  for (int j = 0; j < n; j++) {
+    int date = lots[j].expiration_date;
+    low = stock_upper_bound(dates, low, stock->n_lots, date);
+    positions[j] = low;
+    if ((j == 0 || lots[j - 1].expiration_date != date) &&
+        (low == 0 || dates[low - 1] != date)) {
+      n_added++;
+    }
   }
 
-  stock->name = (char *)malloc(strlen(name) + 1);
-  if (stock->name == NULL) {
-    free(stock);
-    return NULL;
+  if (!stock_reserve(stock, n_added)) {
+    return false;
   }
+  int *quantities = stock->quantities + stock->first_lot;
+  dates = stock->expiration_dates + stock->first_lot;
+
+  int i = stock->n_lots - 1; // Last existing lot not merged yet
+  int w = i + n_added;       // Next slot to write
+  int j = n - 1;             // Last new lot not merged yet
+  while (j >= 0) {
+    int date = lots[j].expiration_date;
+
+    // Shift the existing lots that expire later as one block.
+    int n_later = i + 1 - positions[j];
+    if (n_later > 0 && w != i) {
+      memmove(quantities + w - n_later + 1, quantities + i - n_later + 1,
+              n_later * sizeof(int));
+      memmove(dates + w - n_later + 1, dates + i - n_later + 1,
+              n_later * sizeof(int));
+    }
+    w -= n_later;
+    i -= n_later;
 
-  strcpy(stock->name, name);
-  stock->n_ingredients = 0;
-  stock->total_quantity = 0;
-  stock->ingredients = NULL;
-  stock->next = NULL;
+    int quantity = 0;
+    while (j >= 0 && lots[j].expiration_date == date) {
+      quantity += lots[j--].quantity;
+    }
+    ht->levels[stock->id].total += quantity;
+    if (i >= 0 && dates[i] == date) {
+      quantity += quantities[i--];
+    }
+    quantities[w] = quantity;
+    dates[w--] = date;
+  }
 
-  return stock;
+  stock->n_lots += n_added;
+  stock_update_expiry(ht, stock);
+  stock_track_empty(ht, stock->id, old_total);
+  return true;
+}
+
+inline void stock_remove_expired_ingredients(StockHT *ht, Stock *stock,
+                                             int curr_time) {
+  int old_total = ht->levels[stock->id].total;
+  int *quantities = stock->quantities + stock->first_lot;
+  int *dates = stock->expiration_dates + stock->first_lot;
+  int i = 0;
+  while (i < stock->n_lots && dates[i] <= curr_time) {
+    ht->levels[stock->id].total -= quantities[i];
+    i++;
+  }
+
+  stock->first_lot += i;
+  stock->n_lots -= i;
+  stock_update_expiry(ht, stock);
+  stock_track_empty(ht, stock->id, old_total);
 }
 
-inline void stock_remove_expired_ingredients(Stock *stock, int curr_time) {
-  StockIngredient *curr_ingredient = stock->ingredients;
-  StockIngredient *prev_ingredient = NULL;
-  while (curr_ingredient != NULL &&
-         curr_ingredient->expiration_date <= curr_time) {
-    StockIngredient *next = curr_ingredient->next;
-    stock->total_quantity -= curr_ingredient->quantity;
-    free(curr_ingredient);
-    stock->n_ingredients--;
-    curr_ingredient = next;
+// Return the index of the first lot at which the running sum of `quantities`
+// reaches `quantity` and store that running sum in `prefix`. The sum is
+// computed four lots at a time with SSE2 (in-register prefix sum plus a
+// vectorized compare), so draining many small lots costs a few instructions
+// per lot instead of a pointer chase and a free.
+int stock_find_cut(const int *quantities, int n_lots, int quantity,
+                   int *prefix) {
+  int sum = 0;
+  int i = 0;
+#ifdef __SSE2__
+  __m128i carry = _mm_setzero_si128();
+  __m128i need = _mm_set1_epi32(quantity - 1);
+  for (; i + 4 <= n_lots; i += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(quantities + i));
+    v = _mm_add_epi32(v, _mm_slli_si128(v, 4));
+    v = _mm_add_epi32(v, _mm_slli_si128(v, 8));
+    v = _mm_add_epi32(v, carry);
+    int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(v, need)));
+    if (mask != 0) {
+      int sums[4];
+      int lane = __builtin_ctz(mask);
+      _mm_storeu_si128((__m128i *)sums, v);
+      *prefix = sums[lane];
+      return i + lane;
+    }
+    carry = _mm_shuffle_epi32(v, _MM_SHUFFLE(3, 3, 3, 3));
+  }
+  sum = _mm_cvtsi128_si32(carry);
+#endif
+  for (; i < n_lots; i++) {
+    sum += quantities[i];
+    if (sum >= quantity) {
+      *prefix = sum;
+      return i;
+    }
   }
+  *prefix = sum;
+  return n_lots;
+}
 
-  if (prev_ingredient == NULL) {
-    stock->ingredients = curr_ingredient;
+void stock_remove_ingredient(StockHT *ht, Stock *stock, int quantity) {
+  if (quantity <= 0 || stock->n_lots == 0) {
     return;
   }
 
-  prev_ingredient->next = curr_ingredient;
-}
+  int *quantities = stock->quantities + stock->first_lot;
 
-inline void stock_remove_ingredient(Stock *stock, int quantity) {
-  StockIngredient *curr_ingredient = stock->ingredients;
-  StockIngredient *prev_ingredient = NULL;
-  while (curr_ingredient != NULL && quantity > 0) {
-    if (curr_ingredient->quantity <= quantity) {
-      quantity -= curr_ingredient->quantity;
-      stock->total_quantity -= curr_ingredient->quantity;
-      StockIngredient *next = curr_ingredient->next;
-      free(curr_ingredient);
-      stock->n_ingredients--;
-      curr_ingredient = next;
-    } else {
-      curr_ingredient->quantity -= quantity;
-      stock->total_quantity -= quantity;
-      quantity = 0;
-    }
+  // Most orders are served by the oldest lot alone.
+  if (quantity < quantities[0]) {
+    quantities[0] -= quantity;
+    ht->levels[stock->id].total -= quantity;
+    return;
   }
 
-  if (prev_ingredient == NULL) {
-    stock->ingredients = curr_ingredient;
+  // Drop the whole consumed prefix in one step.
+  int old_total = ht->levels[stock->id].total;
+  int prefix;
+  int cut = stock_find_cut(quantities, stock->n_lots, quantity, &prefix);
+  if (cut == stock->n_lots) {
+    ht->levels[stock->id].total -= prefix;
+    stock->first_lot = 0;
+    stock->n_lots = 0;
+    stock_update_expiry(ht, stock);
+    stock_track_empty(ht, stock->id, old_total);
     return;
   }
 
-  prev_ingredient->next = curr_ingredient;
+  ht->levels[stock->id].total -= quantity;
+  if (prefix == quantity) {
+    cut++;
+  } else {
+    quantities[cut] = prefix - quantity;
+  }
+  stock->first_lot += cut;
+  stock->n_lots -= cut;
+  stock_update_expiry(ht, stock);
+  stock_track_empty(ht, stock->id, old_total);
 }
 
 void free_stock(Stock *stock) {
-  free_stock_ingredient(stock->ingredients);
-  free(stock->name);
-  free(stock);
+  free(stock->quantities);
+  free(stock->expiration_dates);
 }
 
 StockHT *create_stock_ht(int size) {
@@ -490,275 +1317,2037 @@ StockHT *create_stock_ht(int size) {
     return NULL;
   }
 
-  ht->n_elements = 0;
   ht->size = size;
-  ht->stocks = (Stock **)malloc(size * sizeof(Stock *));
-  if (ht->stocks == NULL) {
+  ht->buckets = (int *)malloc(size * sizeof(int));
+  if (ht->buckets == NULL) {
     return NULL;
   }
   for (int i = 0; i < size; i++) {
-    ht->stocks[i] = NULL;
+    ht->buckets[i] = -1;
   }
 
+  ht->n_ids = 0;
+  ht->ids_capacity = STOCK_INIT_IDS;
+  ht->stocks =
+      (Stock *)aligned_alloc(CACHE_LINE, ht->ids_capacity * sizeof(Stock));
+  ht->levels = (StockLevel *)malloc(ht->ids_capacity * sizeof(StockLevel));
+  ht->names = (char **)malloc(ht->ids_capacity * sizeof(char *));
+  ht->chain = (int *)malloc(ht->ids_capacity * sizeof(int));
+  ht->watchers = (int *)malloc(ht->ids_capacity * sizeof(int));
+  ht->shortfalls = (unsigned *)malloc(ht->ids_capacity * sizeof(unsigned));
+  ht->arena = create_arena();
+  if (ht->stocks == NULL || ht->levels == NULL || ht->names == NULL ||
+      ht->chain == NULL || ht->watchers == NULL || ht->shortfalls == NULL ||
+      ht->arena == NULL) {
+    return NULL;
+  }
+
+  ht->empty_mask = ~0ULL;
+  for (int i = 0; i < SIGNATURE_BITS; i++) {
+    ht->nonempty_count[i] = 0;
+  }
+  ht->lots = NULL;
+  ht->lot_table = NULL;
+  ht->lots_capacity = 0;
+
   return ht;
 }
 
 void free_stock_ht(StockHT *ht) {
-  for (int i = 0; i < ht->size; i++) {
-    Stock *stock = ht->stocks[i];
-    while (stock != NULL) {
-      Stock *next = stock->next;
-      free_stock(stock);
-      stock = next;
-    }
+  for (int id = 0; id < ht->n_ids; id++) {
+    free_stock(&ht->stocks[id]);
   }
 
+  free(ht->buckets);
   free(ht->stocks);
+  free(ht->levels);
+  free(ht->names);
+  free(ht->chain);
+  free(ht->watchers);
+  free(ht->shortfalls);
+  free(ht->lots);
+  free(ht->lot_table);
+  free_arena(ht->arena);
   free(ht);
 }
 
-void stock_ht_put(StockHT *ht, Stock *stock) {
-  uint32_t hash = fnv1a_hash_string(stock->name, ht->size);
-  Stock *curr_stock = ht->stocks[hash];
+// Grow the dense arrays; the stock array keeps its cache-line alignment.
+// Returns false if it cannot: the arrays grown so far are kept, but the
+// capacity only changes once all of them have.
+bool stock_ht_grow(StockHT *ht) {
+  int capacity = ht->ids_capacity * 2;
+  Stock *stocks = (Stock *)aligned_alloc(CACHE_LINE, capacity * sizeof(Stock));
+  if (stocks == NULL) {
+    return false;
+  }
+  memcpy(stocks, ht->stocks, ht->n_ids * sizeof(Stock));
+  free(ht->stocks);
+  ht->stocks = stocks;
 
-  if (curr_stock == NULL) {
-    ht->stocks[hash] = stock;
-    stock->next = NULL;
-    ht->n_elements++;
-    return;
+  StockLevel *levels =
+      (StockLevel *)realloc(ht->levels, capacity * sizeof(StockLevel));
+  if (levels == NULL) {
+    return false;
   }
-  stock->next = curr_stock;
-  ht->stocks[hash] = stock;
-  ht->n_elements++;
+  ht->levels = levels;
+  char **names = (char **)realloc(ht->names, capacity * sizeof(char *));
+  if (names == NULL) {
+    return false;
+  }
+  ht->names = names;
+  int *chain = (int *)realloc(ht->chain, capacity * sizeof(int));
+  if (chain == NULL) {
+    return false;
+  }
+  ht->chain = chain;
+  int *watchers = (int *)realloc(ht->watchers, capacity * sizeof(int));
+  if (watchers == NULL) {
+    return false;
+  }
+  ht->watchers = watchers;
+  unsigned *shortfalls =
+      (unsigned *)realloc(ht->shortfalls, capacity * sizeof(unsigned));
+  if (shortfalls == NULL) {
+    return false;
+  }
+  ht->shortfalls = shortfalls;
+  ht->ids_capacity = capacity;
+  return true;
+}
+
+// Make room in the scratch arrays for a restock of `n` lots: twice that many
+// lots, and a grouping table of less than 4n slots with 3n + 1 more ints.
+// Returns false if it cannot.
+bool stock_ht_reserve_lots(StockHT *ht, int n) {
+  if (n <= ht->lots_capacity) {
+    return true;
+  }
+  int capacity = ht->lots_capacity == 0 ? 64 : ht->lots_capacity;
+  while (capacity < n) {
+    capacity *= 2;
+  }
+  StockLot *lots =
+      (StockLot *)realloc(ht->lots, 2 * capacity * sizeof(StockLot));
+  if (lots == NULL) {
+    return false;
+  }
+  ht->lots = lots;
+  int *table = (int *)realloc(ht->lot_table, (7 * capacity + 1) * sizeof(int));
+  if (table == NULL) {
+    return false;
+  }
+  ht->lot_table = table;
+  ht->lots_capacity = capacity;
+  return true;
+}
+
+// Add a new, empty stock with the next free ID.
+Stock *stock_ht_put(StockHT *ht, char *name) {
+  if (ht->n_ids == ht->ids_capacity && !stock_ht_grow(ht)) {
+    return NULL;
+  }
+
+  int id = ht->n_ids;
+  Stock *stock = &ht->stocks[id];
+  ht->names[id] = arena_strdup(ht->arena, name);
+  if (ht->names[id] == NULL || !init_stock(stock, id)) {
+    return NULL;
+  }
+  ht->levels[id].total = 0;
+  ht->levels[id].next_expiry = INT_MAX;
+  ht->watchers[id] = -1;
+  ht->shortfalls[id] = 0;
+  ht->n_ids++;
+
+  uint32_t hash = fnv1a_hash_string(name, ht->size);
+  ht->chain[id] = ht->buckets[hash];
+  ht->buckets[hash] = id;
 
   if (stock_ht_load_factor(ht) >= HT_LOAD_FACTOR) {
     stock_ht_resize(ht);
   }
+
+  return &ht->stocks[id];
 }
 
 inline Stock *stock_ht_get(StockHT *ht, char *name) {
   uint32_t hash = fnv1a_hash_string(name, ht->size);
-  Stock *stock = ht->stocks[hash];
+  int id = ht->buckets[hash];
 
-  if (stock == NULL) {
-    return NULL;
-  }
-
-  while (stock != NULL) {
-    if (strcmp(stock->name, name) == 0) {
-      return stock;
+  while (id != -1) {
+    if (strcmp(ht->names[id], name) == 0) {
+      return &ht->stocks[id];
     }
-    stock = stock->next;
+    id = ht->chain[id];
   }
 
   return NULL;
 }
 
 inline double stock_ht_load_factor(StockHT *ht) {
-  return (double)ht->n_elements / ht->size;
+  return (double)ht->n_ids / ht->size;
 }
 
 inline void stock_ht_resize(StockHT *ht) {
-  StockHT *new_ht = create_stock_ht(ht->size * 2);
-
+  // Only the buckets are rebuilt: IDs and levels do not depend on the hash.
+  free(ht->buckets);
+  ht->size *= 2;
+  ht->buckets = (int *)malloc(ht->size * sizeof(int));
   for (int i = 0; i < ht->size; i++) {
-    Stock *stock = ht->stocks[i];
-    while (stock != NULL) {
-      Stock *next = stock->next;
-      stock->next = NULL;
-      stock_ht_put(new_ht, stock);
-      stock = next;
+    ht->buckets[i] = -1;
+  }
+
+  for (int id = 0; id < ht->n_ids; id++) {
+    uint32_t hash = fnv1a_hash_string(ht->names[id], ht->size);
+    ht->chain[id] = ht->buckets[hash];
+    ht->buckets[hash] = id;
+  }
+}
+
+inline Stock *stock_get_or_create(StockHT *ht, char *name) {
+  Stock *stock = stock_ht_get(ht, name);
+  if (stock == NULL) {
+    stock = stock_ht_put(ht, name);
+  }
+  return stock;
+}
+
+// Check `amount` units of the recipe against the dense stock levels and
+// return the index of the first ingredient in short supply, or -1 if they all
+// fit. With AVX2, eight ingredients are gathered, multiplied and compared at
+// once and the check stops at the first chunk with a shortfall. `stale` is set
+// when a level still counts lots expired at `curr_time`: a shortfall is then
+// still final, since expired lots only make the totals larger, but a fit is
+// not.
+int recipe_first_missing(Recipe *recipe, const StockLevel *levels, int amount,
+                         int curr_time, bool *stale) {
+#ifdef __AVX2__
+  const int *totals = &levels[0].total;
+  const int *expiries = &levels[0].next_expiry;
+  __m256i amount_v = _mm256_set1_epi32(amount);
+  __m256i time_v = _mm256_set1_epi32(curr_time);
+  __m256i expired = _mm256_setzero_si256();
+  for (int i = 0; i < recipe->n_ingredients; i += RECIPE_LANES) {
+    __m256i ids =
+        _mm256_loadu_si256((const __m256i *)(recipe->ingredient_ids + i));
+    __m256i quantities =
+        _mm256_loadu_si256((const __m256i *)(recipe->quantities + i));
+    __m256i available =
+        _mm256_i32gather_epi32(totals, ids, sizeof(StockLevel));
+    __m256i needed = _mm256_mullo_epi32(quantities, amount_v);
+    int missing = _mm256_movemask_ps(
+        _mm256_castsi256_ps(_mm256_cmpgt_epi32(needed, available)));
+    if (missing != 0) {
+      return i + __builtin_ctz(missing);
+    }
+    __m256i next_expiry =
+        _mm256_i32gather_epi32(expiries, ids, sizeof(StockLevel));
+    expired =
+        _mm256_or_si256(expired, _mm256_cmpgt_epi32(time_v, next_expiry));
+    expired = _mm256_or_si256(expired, _mm256_cmpeq_epi32(time_v, next_expiry));
+  }
+  *stale = _mm256_movemask_epi8(expired) != 0;
+#else
+  *stale = false;
+  for (int i = 0; i < recipe->n_ingredients; i++) {
+    const StockLevel *level = &levels[recipe->ingredient_ids[i]];
+    if (recipe->quantities[i] * amount > level->total) {
+      return i;
+    }
+    *stale |= level->next_expiry <= curr_time;
+  }
+#endif
+  return -1;
+}
+// END STOCK IMPLEMENTATION ========================
+
+// ORDER IMPLEMENTATION ===============================
+// Orders and recipes are addressed by their index in ORDER_POOL and
+// RECIPE_POOL, so an order takes 20 bytes instead of 32.
+struct Order {
+  int recipe; // ID
+  int amount; // Number of orders
+  int arrival_time;
+  int total_weight;
+  int next; // ID of the next order in the truck queue, -1 at the end
+};
+
+Order *order_at(int id) { return (Order *)pool_at(ORDER_POOL, id); }
+
+// Return the ID of a new order, or -1 if it cannot be created.
+int create_order(Recipe *recipe, int amount, int arrival_time) {
+  int id = pool_alloc(ORDER_POOL);
+  if (id == -1) {
+    return -1;
+  }
+
+  Order *order = order_at(id);
+  order->recipe = recipe->id;
+  order->amount = amount;
+  order->arrival_time = arrival_time;
+  order->total_weight = recipe->weight * amount;
+  order->next = -1;
+
+  return id;
+}
+
+void free_order(int id) { pool_free(ORDER_POOL, id); }
+
+// Orders in arrival order. A directory over blocks of 64 arrival times keeps
+// the last order of each block, with a bitmap of the non-empty blocks and a
+// summary of its non-zero words, so that an order arriving anywhere is
+// inserted after walking at most its own block.
+struct OrderQueue {
+  int head; // -1 when empty
+  int tail;
+  int *last; // By block, -1 when empty
+  uint64_t *blocks;
+  uint64_t *words;
+  int n_blocks;
+  // Orders of the truck load being sorted, and room to sort them
+  int *load;
+  int *load_scratch;
+  int load_capacity;
+};
+
+OrderQueue *create_order_queue() {
+  OrderQueue *queue = (OrderQueue *)malloc(sizeof(OrderQueue));
+  if (queue == NULL) {
+    return NULL;
+  }
+
+  queue->head = -1;
+  queue->tail = -1;
+  queue->last = NULL;
+  queue->blocks = NULL;
+  queue->words = NULL;
+  queue->n_blocks = 0;
+  queue->load = NULL;
+  queue->load_scratch = NULL;
+  queue->load_capacity = 0;
+  return queue;
+}
+
+void free_order_queue(OrderQueue *queue) {
+  int id = queue->head;
+  while (id != -1) {
+    int next = order_at(id)->next;
+    free_order(id);
+    id = next;
+  }
+  free(queue->last);
+  free(queue->blocks);
+  free(queue->words);
+  free(queue->load);
+  free(queue->load_scratch);
+  free(queue);
+}
+
+// Grow the directory to cover `arrival_time`. Returns false if it cannot.
+bool order_queue_reserve(OrderQueue *queue, int arrival_time) {
+  int block = arrival_time >> TRUCK_BLOCK_BITS;
+  if (block < queue->n_blocks) {
+    return true;
+  }
+  int n_blocks = queue->n_blocks == 0 ? TRUCK_INIT_BLOCKS : queue->n_blocks;
+  while (n_blocks <= block) {
+    n_blocks *= 2;
+  }
+
+  int *last = (int *)realloc(queue->last, n_blocks * sizeof(int));
+  if (last == NULL) {
+    return false;
+  }
+  queue->last = last;
+  uint64_t *blocks =
+      (uint64_t *)realloc(queue->blocks, n_blocks / 64 * sizeof(uint64_t));
+  if (blocks == NULL) {
+    return false;
+  }
+  queue->blocks = blocks;
+  uint64_t *words =
+      (uint64_t *)realloc(queue->words, n_blocks / 4096 * sizeof(uint64_t));
+  if (words == NULL) {
+    return false;
+  }
+  queue->words = words;
+
+  int old = queue->n_blocks;
+  memset(last + old, -1, (n_blocks - old) * sizeof(int));
+  memset(blocks + old / 64, 0, (n_blocks - old) / 64 * sizeof(uint64_t));
+  memset(words + old / 4096, 0, (n_blocks - old) / 4096 * sizeof(uint64_t));
+  queue->n_blocks = n_blocks;
+  return true;
+}
+
+// Record an order inserted in a block the directory covers.
+inline void order_queue_mark(OrderQueue *queue, int id) {
+  int arrival_time = order_at(id)->arrival_time;
+  int block = arrival_time >> TRUCK_BLOCK_BITS;
+  int last = queue->last[block];
+  if (last == -1 || order_at(last)->arrival_time < arrival_time) {
+    queue->last[block] = id;
+  }
+  queue->blocks[block / 64] |= 1ULL << (block % 64);
+  queue->words[block / 4096] |= 1ULL << (block / 64 % 64);
+}
+
+// Forget an order leaving the head of the queue.
+inline void order_queue_unmark(OrderQueue *queue, int id) {
+  int block = order_at(id)->arrival_time >> TRUCK_BLOCK_BITS;
+  if (block < queue->n_blocks && queue->last[block] == id) {
+    queue->last[block] = -1;
+    queue->blocks[block / 64] &= ~(1ULL << (block % 64));
+    if (queue->blocks[block / 64] == 0) {
+      queue->words[block / 4096] &= ~(1ULL << (block / 64 % 64));
+    }
+  }
+}
+
+// Return the last non-empty block before `block`, which the directory covers,
+// or -1 if there is none.
+inline int order_queue_prev_block(OrderQueue *queue, int block) {
+  int word = block / 64;
+  uint64_t bits = queue->blocks[word] & ((1ULL << (block % 64)) - 1);
+  if (bits == 0) {
+    int summary = word / 64;
+    uint64_t words = queue->words[summary] & ((1ULL << (word % 64)) - 1);
+    while (words == 0) {
+      if (--summary < 0) {
+        return -1;
+      }
+      words = queue->words[summary];
+    }
+    word = summary * 64 + 63 - __builtin_clzll(words);
+    bits = queue->blocks[word];
+  }
+  return word * 64 + 63 - __builtin_clzll(bits);
+}
+
+inline void order_queue_enqueue(OrderQueue *queue, int id) {
+  if (order_queue_reserve(queue, order_at(id)->arrival_time)) {
+    order_queue_mark(queue, id);
+  }
+  if (queue->tail == -1) {
+    queue->head = id;
+    queue->tail = id;
+    return;
+  }
+
+  order_at(queue->tail)->next = id;
+  queue->tail = id;
+}
+
+inline void order_enqueue_by_weight(int *list, int id) {
+  // Add the order in decreasing order according to the weight in the list,
+  // if the weight is the same, order by arrival time
+  if (*list == -1) {
+    *list = id;
+    return;
+  }
+
+  Order *order = order_at(id);
+  int curr = *list;
+  int prev = -1;
+  while (curr != -1 && order_at(curr)->total_weight > order->total_weight) {
+    prev = curr;
+    curr = order_at(curr)->next;
+  }
+
+  // Find the correct position to insert the order (by arrival time).
+  while (curr != -1 && order_at(curr)->total_weight == order->total_weight &&
+         order_at(curr)->arrival_time < order->arrival_time) {
+    prev = curr;
+    curr = order_at(curr)->next;
+  }
+
+  if (prev == -1) {
+    order->next = *list;
+    *list = id;
+    return;
+  }
+
+  order_at(prev)->next = id;
+  order->next = curr;
+}
+
+// END ORDER IMPLEMENTATION ===========================
+
+// EVENT IMPLEMENTATION ==============================
+struct Event {
+  long time;
+  int kind;
+  int id; // Of the courier, or whatever the kind refers to
+};
+
+// A min-heap of the timed events, ordered by time, then by kind and id so
+// that the events due at once are handled in a fixed order. A command only
+// looks at the root, however many events are pending.
+struct Scheduler {
+  Event *heap;
+  int n_events;
+  int capacity;
+};
+
+Scheduler *create_scheduler() {
+  Scheduler *scheduler = (Scheduler *)malloc(sizeof(Scheduler));
+  if (scheduler == NULL) {
+    return NULL;
+  }
+
+  scheduler->heap =
+      (Event *)malloc(SCHEDULER_INIT_CAPACITY * sizeof(Event));
+  if (scheduler->heap == NULL) {
+    free(scheduler);
+    return NULL;
+  }
+  scheduler->n_events = 0;
+  scheduler->capacity = SCHEDULER_INIT_CAPACITY;
+  return scheduler;
+}
+
+void free_scheduler(Scheduler *scheduler) {
+  free(scheduler->heap);
+  free(scheduler);
+}
+
+bool event_before(const Event *a, const Event *b) {
+  if (a->time != b->time) {
+    return a->time < b->time;
+  }
+  if (a->kind != b->kind) {
+    return a->kind < b->kind;
+  }
+  return a->id < b->id;
+}
+
+// Schedule an event. Returns false if it cannot be scheduled.
+bool scheduler_push(Scheduler *scheduler, long time, int kind, int id) {
+  if (scheduler->n_events == scheduler->capacity) {
+    int new_capacity = 2 * scheduler->capacity;
+    Event *heap =
+        (Event *)realloc(scheduler->heap, new_capacity * sizeof(Event));
+    if (heap == NULL) {
+      return false;
+    }
+    scheduler->heap = heap;
+    scheduler->capacity = new_capacity;
+  }
+
+  Event event = {time, kind, id};
+  int i = scheduler->n_events++;
+  while (i > 0 && event_before(&event, &scheduler->heap[(i - 1) / 2])) {
+    scheduler->heap[i] = scheduler->heap[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  scheduler->heap[i] = event;
+  return true;
+}
+
+void scheduler_sift_down(Scheduler *scheduler, int i) {
+  Event *heap = scheduler->heap;
+  int n = scheduler->n_events;
+  Event event = heap[i];
+  while (2 * i + 1 < n) {
+    int child = 2 * i + 1;
+    if (child + 1 < n && event_before(&heap[child + 1], &heap[child])) {
+      child++;
+    }
+    if (!event_before(&heap[child], &event)) {
+      break;
+    }
+    heap[i] = heap[child];
+    i = child;
+  }
+  heap[i] = event;
+}
+
+void scheduler_pop(Scheduler *scheduler) {
+  scheduler->heap[0] = scheduler->heap[--scheduler->n_events];
+  if (scheduler->n_events > 0) {
+    scheduler_sift_down(scheduler, 0);
+  }
+}
+
+// Drop every event of the given kind, then rebuild the heap.
+void scheduler_drop(Scheduler *scheduler, int kind) {
+  int n = 0;
+  for (int i = 0; i < scheduler->n_events; i++) {
+    if (scheduler->heap[i].kind != kind) {
+      scheduler->heap[n++] = scheduler->heap[i];
+    }
+  }
+  scheduler->n_events = n;
+  for (int i = n / 2 - 1; i >= 0; i--) {
+    scheduler_sift_down(scheduler, i);
+  }
+}
+
+struct Courier {
+  int period; // Leaves at every multiple of it
+  int capacity;
+};
+
+// The couriers in input order. Each one has a departure event scheduled at
+// the time it next leaves; the ones that left at `departed_time` are kept,
+// in input order, as they leave again if the time is checked again.
+struct Fleet {
+  Courier *couriers;
+  int *departed;
+  int n_couriers;
+  int n_departed;
+  int capacity;
+  long departed_time;
+};
+
+Fleet *create_fleet() {
+  Fleet *fleet = (Fleet *)malloc(sizeof(Fleet));
+  if (fleet == NULL) {
+    return NULL;
+  }
+
+  fleet->couriers = NULL;
+  fleet->departed = NULL;
+  fleet->n_couriers = 0;
+  fleet->n_departed = 0;
+  fleet->capacity = 0;
+  fleet->departed_time = -1;
+  return fleet;
+}
+
+void free_fleet(Fleet *fleet) {
+  free(fleet->couriers);
+  free(fleet->departed);
+  free(fleet);
+}
+
+// Remove every courier along with its departure event.
+void fleet_clear(Fleet *fleet, Scheduler *scheduler) {
+  scheduler_drop(scheduler, EVENT_DEPARTURE);
+  fleet->n_couriers = 0;
+  fleet->n_departed = 0;
+  fleet->departed_time = -1;
+}
+
+// Add a courier leaving every `period` time units from the current time on.
+// A courier with no period never leaves and is not added. Returns false if
+// it cannot be added.
+bool fleet_add(Fleet *fleet, Scheduler *scheduler, int period, int capacity) {
+  if (period <= 0) {
+    return true;
+  }
+  if (fleet->n_couriers == fleet->capacity) {
+    int new_capacity = fleet->capacity == 0 ? 4 : 2 * fleet->capacity;
+    Courier *couriers =
+        (Courier *)realloc(fleet->couriers, new_capacity * sizeof(Courier));
+    if (couriers == NULL) {
+      return false;
+    }
+    fleet->couriers = couriers;
+    int *departed = (int *)realloc(fleet->departed, new_capacity * sizeof(int));
+    if (departed == NULL) {
+      return false;
+    }
+    fleet->departed = departed;
+    fleet->capacity = new_capacity;
+  }
+
+  // First due at the next non-zero multiple of the period
+  long time = CURR_TIME > 0 ? CURR_TIME : 1;
+  if (!scheduler_push(scheduler, (time + period - 1) / period * period,
+                      EVENT_DEPARTURE, fleet->n_couriers)) {
+    return false;
+  }
+  int c = fleet->n_couriers++;
+  fleet->couriers[c].period = period;
+  fleet->couriers[c].capacity = capacity;
+  return true;
+}
+
+// Handle the departure event of a courier, already popped from the
+// scheduler: it leaves if the event is due now, and its next departure is
+// scheduled. An event left behind by a time that was never checked is only
+// moved to the courier's next departure.
+void fleet_depart(Fleet *fleet, Scheduler *scheduler, OrderQueue *truck_queue,
+                  const Event *event) {
+  Courier *courier = &fleet->couriers[event->id];
+  long next = ((long)CURR_TIME + courier->period - 1) / courier->period *
+              courier->period;
+  if (event->time == CURR_TIME) {
+    fleet->departed[fleet->n_departed++] = event->id;
+    order_queue_dequeue(truck_queue, courier->capacity);
+    next += courier->period;
+  }
+  // The event was just popped, so there is room to push it back
+  scheduler_push(scheduler, next, EVENT_DEPARTURE, event->id);
+}
+
+// Send again the couriers that left at the current time, as a check may be
+// repeated before the time changes, or forget them once it has changed.
+void fleet_repeat(Fleet *fleet, OrderQueue *truck_queue) {
+  if (fleet->departed_time != CURR_TIME) {
+    fleet->departed_time = CURR_TIME;
+    fleet->n_departed = 0;
+    return;
+  }
+  for (int k = 0; k < fleet->n_departed; k++) {
+    order_queue_dequeue(truck_queue,
+                        fleet->couriers[fleet->departed[k]].capacity);
+  }
+}
+
+// Handle the events due at the current time, if any.
+void scheduler_run(Scheduler *scheduler, Fleet *fleet,
+                   OrderQueue *truck_queue) {
+  if ((scheduler->n_events > 0 && scheduler->heap[0].time <= CURR_TIME) ||
+      fleet->departed_time == CURR_TIME) {
+    scheduler_run_due(scheduler, fleet, truck_queue);
+  }
+}
+
+void scheduler_run_due(Scheduler *scheduler, Fleet *fleet,
+                       OrderQueue *truck_queue) {
+  fleet_repeat(fleet, truck_queue);
+
+  while (scheduler->n_events > 0 && scheduler->heap[0].time <= CURR_TIME) {
+    Event event = scheduler->heap[0];
+    scheduler_pop(scheduler);
+    switch (event.kind) {
+    case EVENT_DEPARTURE:
+      fleet_depart(fleet, scheduler, truck_queue, &event);
+      break;
+    }
+  }
+}
+// END EVENT IMPLEMENTATION ==========================
+
+// WAITING IMPLEMENTATION ==============================
+// Waiting orders live in per-recipe FIFO buckets (see Recipe). The queue
+// itself only holds the buckets woken up by the current restock and the heap
+// used to check them again in arrival order.
+inline void init_waiting_bucket(WaitingBucket *bucket) {
+  bucket->arrivals = NULL;
+  bucket->n_arrivals = 0;
+  bucket->arrivals_capacity = 0;
+  bucket->cancelled = NULL;
+  bucket->n_live = 0;
+  bucket->run_amounts = NULL;
+  bucket->run_firsts = NULL;
+  bucket->run_ends = NULL;
+  bucket->first_run = 0;
+  bucket->n_runs = 0;
+  bucket->n_live_runs = 0;
+  bucket->runs_capacity = 0;
+  bucket->segments = NULL;
+  bucket->n_segments = 0;
+  bucket->segments_capacity = 0;
+  bucket->n_scanned = 0;
+  bucket->pending = NULL;
+  bucket->n_pending = 0;
+  bucket->n_spilled = 0;
+  bucket->spilled_pos = -1;
+}
+
+inline void free_waiting_bucket(WaitingBucket *bucket) {
+  free(bucket->arrivals);
+  free(bucket->cancelled);
+  free(bucket->run_amounts);
+  free(bucket->segments);
+  free(bucket->pending);
+}
+
+// Drop the tombstones: slide the live runs and their arrival times to the
+// front, merging runs left adjacent with the same amount.
+void waiting_bucket_compact(WaitingBucket *bucket) {
+  int n_arrivals = 0;
+  int n_runs = 0;
+  for (int r = bucket->first_run; r < bucket->n_runs; r++) {
+    int first = bucket->run_firsts[r];
+    int n = bucket->run_ends[r] - first;
+    if (bucket->cancelled != NULL) {
+      n = 0;
+      for (int i = first; i < bucket->run_ends[r]; i++) {
+        if (!bucket->cancelled[i]) {
+          bucket->arrivals[n_arrivals + n++] = bucket->arrivals[i];
+        }
+      }
+    } else {
+      memmove(bucket->arrivals + n_arrivals, bucket->arrivals + first,
+              n * sizeof(int));
+    }
+    if (n == 0) {
+      continue;
+    }
+
+    if (n_runs > 0 && bucket->run_amounts[n_runs - 1] == bucket->run_amounts[r]) {
+      bucket->run_ends[n_runs - 1] += n;
+    } else {
+      bucket->run_amounts[n_runs] = bucket->run_amounts[r];
+      bucket->run_firsts[n_runs] = n_arrivals;
+      bucket->run_ends[n_runs] = n_arrivals + n;
+      n_runs++;
+    }
+    n_arrivals += n;
+  }
+
+  bucket->n_arrivals = n_arrivals;
+  bucket->first_run = 0;
+  bucket->n_runs = n_runs;
+  bucket->n_live_runs = n_runs;
+  free(bucket->cancelled);
+  bucket->cancelled = NULL;
+}
+
+// Make room for one more arrival time and one more run, compacting the
+// arrays when at least half of a full one is dead and growing them otherwise.
+bool waiting_bucket_reserve(WaitingBucket *bucket) {
+  if ((bucket->n_arrivals == bucket->arrivals_capacity &&
+       2 * bucket->n_live <= bucket->n_arrivals && bucket->n_arrivals > 0) ||
+      (bucket->n_runs == bucket->runs_capacity &&
+       2 * bucket->n_live_runs <= bucket->n_runs && bucket->n_runs > 0)) {
+    waiting_bucket_compact(bucket);
+  }
+
+  if (bucket->n_arrivals == bucket->arrivals_capacity) {
+    int capacity = bucket->arrivals_capacity == 0
+                       ? WAITING_INIT_CAPACITY
+                       : 2 * bucket->arrivals_capacity;
+    int *arrivals = (int *)realloc(bucket->arrivals, capacity * sizeof(int));
+    if (arrivals == NULL) {
+      return false;
+    }
+    bucket->arrivals = arrivals;
+    if (bucket->cancelled != NULL) {
+      bool *cancelled =
+          (bool *)realloc(bucket->cancelled, capacity * sizeof(bool));
+      if (cancelled == NULL) {
+        return false;
+      }
+      bucket->cancelled = cancelled;
+    }
+    bucket->arrivals_capacity = capacity;
+  }
+
+  if (bucket->n_runs == bucket->runs_capacity) {
+    int old_capacity = bucket->runs_capacity;
+    int capacity =
+        old_capacity == 0 ? WAITING_INIT_CAPACITY : 2 * old_capacity;
+    int *runs = (int *)realloc(bucket->run_amounts, 3 * capacity * sizeof(int));
+    if (runs == NULL) {
+      return false;
+    }
+    // Move the run_ends then the run_firsts to their new offsets
+    memmove(runs + 2 * capacity, runs + 2 * old_capacity,
+            bucket->n_runs * sizeof(int));
+    memmove(runs + capacity, runs + old_capacity,
+            bucket->n_runs * sizeof(int));
+    bucket->run_amounts = runs;
+    bucket->run_firsts = runs + capacity;
+    bucket->run_ends = runs + 2 * capacity;
+    bucket->runs_capacity = capacity;
+  }
+
+  return true;
+}
+
+// Append a waiting order, extending the last run if it has the same amount.
+inline bool waiting_bucket_push(WaitingBucket *bucket, int amount,
+                                int arrival_time) {
+  if (bucket->n_live == 0) {
+    // Everything left is a tombstone
+    bucket->n_arrivals = 0;
+    bucket->first_run = 0;
+    bucket->n_runs = 0;
+    bucket->n_live_runs = 0;
+    free(bucket->cancelled);
+    bucket->cancelled = NULL;
+  }
+  if (!waiting_bucket_reserve(bucket)) {
+    return false;
+  }
+
+  int last = bucket->n_runs - 1;
+  if (last >= bucket->first_run && bucket->run_amounts[last] == amount) {
+    // The last run always ends at the last arrival time
+    if (bucket->run_firsts[last] == bucket->run_ends[last]) {
+      bucket->n_live_runs++;
+    }
+    bucket->run_ends[last]++;
+  } else {
+    bucket->run_amounts[bucket->n_runs] = amount;
+    bucket->run_firsts[bucket->n_runs] = bucket->n_arrivals;
+    bucket->run_ends[bucket->n_runs] = bucket->n_arrivals + 1;
+    bucket->n_runs++;
+    bucket->n_live_runs++;
+  }
+  if (bucket->cancelled != NULL) {
+    bucket->cancelled[bucket->n_arrivals] = false;
+  }
+  bucket->arrivals[bucket->n_arrivals++] = arrival_time;
+  bucket->n_live++;
+  return true;
+}
+
+// Return the first non-empty run from `r` on, or n_runs if there is none.
+inline int waiting_bucket_next_run(WaitingBucket *bucket, int r) {
+  if (bucket->cancelled != NULL) {
+    while (r < bucket->n_runs) {
+      waiting_bucket_skip_cancelled(bucket, r);
+      if (bucket->run_firsts[r] != bucket->run_ends[r]) {
+        break;
+      }
+      r++;
+    }
+    return r;
+  }
+  while (r < bucket->n_runs && bucket->run_firsts[r] == bucket->run_ends[r]) {
+    r++;
+  }
+  return r;
+}
+
+// Move the head of run `r` past its cancelled orders, so that it is always a
+// waiting order or the end of the run.
+inline void waiting_bucket_skip_cancelled(WaitingBucket *bucket, int r) {
+  int first = bucket->run_firsts[r];
+  if (bucket->cancelled == NULL || first == bucket->run_ends[r] ||
+      !bucket->cancelled[first]) {
+    return;
+  }
+  while (first < bucket->run_ends[r] && bucket->cancelled[first]) {
+    first++;
+  }
+  bucket->run_firsts[r] = first;
+  if (first == bucket->run_ends[r]) {
+    bucket->n_live_runs--;
+  }
+}
+
+// Flag the waiting order in `slot` as cancelled. Its run is only updated once
+// the order reaches the run's head.
+bool waiting_bucket_cancel(WaitingBucket *bucket, int slot) {
+  if (bucket->cancelled == NULL) {
+    bucket->cancelled =
+        (bool *)calloc(bucket->arrivals_capacity, sizeof(bool));
+    if (bucket->cancelled == NULL) {
+      return false;
+    }
+  }
+  bucket->cancelled[slot] = true;
+  bucket->n_live--;
+  return true;
+}
+
+// Recipe and arrival slot of a waiting order, by arrival time
+struct WaitingEntry {
+  int arrival_time; // Or INDEX_FREE, INDEX_DELETED
+  int slot;
+  int recipe; // ID
+};
+
+// Orders of a bucket written at once to the spill file: `n` records from
+// `offset`, in arrival order
+struct SpillSegment {
+  long offset;
+  int n;
+  int first_arrival;
+  int last_arrival;
+};
+
+// A spilled order. The arrival time of a cancelled one is complemented.
+struct SpillRecord {
+  int arrival_time;
+  int amount;
+};
+
+struct WaitingQueue {
+  int woken; // Recipe ID linked through watch_next, -1 if none
+  int *heap; // Recipe IDs keyed by the arrival time of each bucket's cursor
+  int heap_capacity;
+  // With PARALLEL_RESCAN, the woken buckets also in the order they were woken,
+  // while `in_sync`, and their checks made ahead on several threads
+  int *speculated; // Recipe IDs
+  RecipeCheck *checks;
+  int n_speculated;
+  int speculated_capacity;
+  bool in_sync;
+  // Stocks purged while the checks are applied, marked with `stamp`
+  int *touched;
+  int touched_capacity;
+  int stamp;
+  bool purged;
+  uint64_t empty_mask; // Of the stocks the checks were made against
+  // Every waiting order by arrival time, which is its ID for handle_cancel.
+  // Open addressing with linear probing, at most half full counting the
+  // deleted entries.
+  WaitingEntry *index;
+  int index_size;
+  int index_n;
+  int index_used;
+  // The table replaced by the last rehash, reused by the next one if it
+  // keeps the same size, as it does once the waiting orders stop growing
+  WaitingEntry *spare_index;
+  int spare_size;
+  // Anonymous spill file, made of one slot per segment. The slots of the
+  // segments read back or dropped are reused, and the file is emptied once no
+  // bucket has spilled orders, so it holds at most the segments spilled at
+  // once.
+  FILE *spill_file;
+  long spill_end;
+  long *free_slots; // Offsets of the unused slots before spill_end
+  int n_free_slots;
+  int free_slots_capacity; // At least the slots before spill_end
+#ifdef DEBUG
+  long spill_peak; // Largest spill_end
+#endif
+  int n_resident; // Waiting orders in memory
+  int *spilled; // IDs of the recipes with spilled orders
+  int n_spilled;
+  int spilled_capacity;
+};
+
+WaitingQueue *create_waiting_queue() {
+  WaitingQueue *queue = (WaitingQueue *)malloc(sizeof(WaitingQueue));
+  if (queue == NULL) {
+    return NULL;
+  }
+
+  queue->woken = -1;
+  queue->heap = NULL;
+  queue->heap_capacity = 0;
+  queue->speculated = NULL;
+  queue->checks = NULL;
+  queue->n_speculated = 0;
+  queue->speculated_capacity = 0;
+  queue->in_sync = true;
+  queue->touched = NULL;
+  queue->touched_capacity = 0;
+  queue->stamp = 0;
+  queue->purged = false;
+  queue->empty_mask = 0;
+  queue->index =
+      (WaitingEntry *)malloc(WAITING_INDEX_INIT_SIZE * sizeof(WaitingEntry));
+  if (queue->index == NULL) {
+    free(queue);
+    return NULL;
+  }
+  for (int i = 0; i < WAITING_INDEX_INIT_SIZE; i++) {
+    queue->index[i].arrival_time = INDEX_FREE;
+  }
+  queue->index_size = WAITING_INDEX_INIT_SIZE;
+  queue->index_n = 0;
+  queue->index_used = 0;
+  queue->spare_index = NULL;
+  queue->spare_size = 0;
+  queue->spill_file = NULL;
+  queue->spill_end = 0;
+  queue->free_slots = NULL;
+  queue->n_free_slots = 0;
+  queue->free_slots_capacity = 0;
+#ifdef DEBUG
+  queue->spill_peak = 0;
+#endif
+  queue->n_resident = 0;
+  queue->spilled = NULL;
+  queue->n_spilled = 0;
+  queue->spilled_capacity = 0;
+  return queue;
+}
+
+void free_waiting_queue(WaitingQueue *queue) {
+  free(queue->heap);
+  free(queue->speculated);
+  free(queue->checks);
+  free(queue->touched);
+  free(queue->index);
+  free(queue->spare_index);
+  free(queue->spilled);
+  free(queue->free_slots);
+  if (queue->spill_file != NULL) {
+    fclose(queue->spill_file);
+  }
+  free(queue);
+}
+
+inline void recipe_watch(StockHT *stock_ht, Recipe *recipe, int id) {
+  recipe->watching = id;
+  recipe->watch_prev = -1;
+  recipe->watch_next = stock_ht->watchers[id];
+  if (recipe->watch_next != -1) {
+    recipe_at(recipe->watch_next)->watch_prev = recipe->id;
+  }
+  stock_ht->watchers[id] = recipe->id;
+}
+
+inline void recipe_unwatch(StockHT *stock_ht, Recipe *recipe) {
+  if (recipe->watch_prev == -1) {
+    stock_ht->watchers[recipe->watching] = recipe->watch_next;
+  } else {
+    recipe_at(recipe->watch_prev)->watch_next = recipe->watch_next;
+  }
+  if (recipe->watch_next != -1) {
+    recipe_at(recipe->watch_next)->watch_prev = recipe->watch_prev;
+  }
+  recipe->watching = WATCH_NONE;
+}
+
+// Append a new order of `amount` units of the recipe, blocked by
+// `missing_id`, to the recipe's bucket.
+void waiting_queue_add(WaitingQueue *queue, StockHT *stock_ht, Recipe *recipe,
+                       int amount, int arrival_time, int missing_id) {
+  WaitingBucket *bucket = &recipe->waiting;
+  if (bucket->n_spilled > 0) {
+    // Behind the spilled orders
+    if (!waiting_queue_defer(queue, recipe, amount, arrival_time)) {
+      return;
+    }
+  } else {
+    int slot = bucket->n_arrivals;
+    if (!waiting_index_reserve(queue, 1) ||
+        !waiting_bucket_push(bucket, amount, arrival_time)) {
+      return;
+    }
+    if (bucket->n_arrivals != slot + 1) {
+      // Compacted to make room: the waiting orders have moved
+      slot = bucket->n_arrivals - 1;
+      waiting_index_renumber(queue, recipe);
+    }
+    waiting_index_put(queue, arrival_time, recipe, slot);
+    queue->n_resident++;
+  }
+
+  if (recipe->watching == WATCH_NONE) {
+    recipe_watch(stock_ht, recipe, missing_id);
+  } else if (recipe->watching != WATCH_PENDING &&
+             amount < recipe->min_amount) {
+    // The new smallest amount is blocked by `missing_id`, and so is every
+    // larger one: the bucket now waits for that stock instead.
+    recipe_unwatch(stock_ht, recipe);
+    recipe_watch(stock_ht, recipe, missing_id);
+  }
+  if (amount < recipe->min_amount) {
+    recipe->min_amount = amount;
+  }
+
+  // During a long shortage, move the growing buckets out of memory: they
+  // are only read again once a restock unblocks them
+  if (recipe->watching >= 0) {
+    waiting_queue_relieve(queue, recipe);
+  }
+}
+
+// Move the buckets blocked by a restocked stock to the woken list.
+void waiting_queue_wake(WaitingQueue *queue, StockHT *stock_ht, int id) {
+  int recipe_id = stock_ht->watchers[id];
+  stock_ht->watchers[id] = -1;
+  while (recipe_id != -1) {
+    Recipe *recipe = recipe_at(recipe_id);
+    recipe->watching = WATCH_PENDING;
+    recipe_id = recipe->watch_next;
+    waiting_queue_push_woken(queue, recipe);
+#if PARALLEL_RESCAN > 0
+    waiting_queue_record(queue, recipe);
+#endif
+  }
+}
+
+// Put a pending bucket at the head of the woken list, which is linked both
+// ways so that a bucket emptied by cancellations can leave it.
+void waiting_queue_push_woken(WaitingQueue *queue, Recipe *recipe) {
+  recipe->watch_prev = -1;
+  recipe->watch_next = queue->woken;
+  if (queue->woken != -1) {
+    recipe_at(queue->woken)->watch_prev = recipe->id;
+  }
+  queue->woken = recipe->id;
+}
+
+// Take a pending bucket off the woken list. The parallel checks, recorded
+// in the order of the list, no longer match it.
+void waiting_queue_unwake(WaitingQueue *queue, Recipe *recipe) {
+  if (recipe->watch_prev == -1) {
+    queue->woken = recipe->watch_next;
+  } else {
+    recipe_at(recipe->watch_prev)->watch_next = recipe->watch_next;
+  }
+  if (recipe->watch_next != -1) {
+    recipe_at(recipe->watch_next)->watch_prev = recipe->watch_prev;
+  }
+  recipe->watching = WATCH_NONE;
+  queue->in_sync = false;
+}
+
+// Append a woken bucket to the array the parallel checks are split from, or
+// give up on them until the woken list is emptied again.
+void waiting_queue_record(WaitingQueue *queue, Recipe *recipe) {
+  if (!queue->in_sync) {
+    return;
+  }
+  if (queue->n_speculated == queue->speculated_capacity) {
+    int capacity =
+        queue->speculated_capacity == 0 ? 1024 : 2 * queue->speculated_capacity;
+    int *speculated =
+        (int *)realloc(queue->speculated, capacity * sizeof(int));
+    if (speculated == NULL) {
+      queue->in_sync = false;
+      return;
+    }
+    queue->speculated = speculated;
+    RecipeCheck *checks =
+        (RecipeCheck *)realloc(queue->checks, capacity * sizeof(RecipeCheck));
+    if (checks == NULL) {
+      queue->in_sync = false;
+      return;
+    }
+    queue->checks = checks;
+    queue->speculated_capacity = capacity;
+  }
+  queue->speculated[queue->n_speculated++] = recipe->id;
+}
+
+// Orders are added and mostly sent in arrival order, so consecutive arrival
+// times are kept in consecutive entries
+inline uint32_t waiting_index_hash(int arrival_time, int size) {
+  return (uint32_t)arrival_time & (size - 1);
+}
+
+inline WaitingEntry *waiting_index_get(WaitingQueue *queue, int arrival_time) {
+  uint32_t i = waiting_index_hash(arrival_time, queue->index_size);
+  while (queue->index[i].arrival_time != INDEX_FREE) {
+    if (queue->index[i].arrival_time == arrival_time) {
+      return &queue->index[i];
+    }
+    i = (i + 1) & (queue->index_size - 1);
+  }
+  return NULL;
+}
+
+// Make room for `n` more entries, so that the next `n` puts cannot fail.
+// Returns false if it cannot.
+bool waiting_index_reserve(WaitingQueue *queue, int n) {
+  if (2 * (queue->index_used + n) > queue->index_size) {
+    // Rehash without the deleted entries, to at most a quarter full
+    int size = WAITING_INDEX_INIT_SIZE;
+    while (size < 4 * (queue->index_n + n)) {
+      size *= 2;
+    }
+    WaitingEntry *index = queue->spare_index;
+    if (queue->spare_size != size) {
+      free(queue->spare_index);
+      queue->spare_index = NULL;
+      queue->spare_size = 0;
+      index = (WaitingEntry *)malloc(size * sizeof(WaitingEntry));
+      if (index == NULL) {
+        return false;
+      }
+    }
+    for (int i = 0; i < size; i++) {
+      index[i].arrival_time = INDEX_FREE;
+    }
+    for (int i = 0; i < queue->index_size; i++) {
+      if (queue->index[i].arrival_time >= 0) {
+        uint32_t j = waiting_index_hash(queue->index[i].arrival_time, size);
+        while (index[j].arrival_time != INDEX_FREE) {
+          j = (j + 1) & (size - 1);
+        }
+        index[j] = queue->index[i];
+      }
+    }
+    queue->spare_index = queue->index;
+    queue->spare_size = queue->index_size;
+    queue->index = index;
+    queue->index_size = size;
+    queue->index_used = queue->index_n;
+  }
+  return true;
+}
+
+// Add an entry, in room made by waiting_index_reserve.
+void waiting_index_put(WaitingQueue *queue, int arrival_time, Recipe *recipe,
+                       int slot) {
+  uint32_t i = waiting_index_hash(arrival_time, queue->index_size);
+  while (queue->index[i].arrival_time != INDEX_FREE) {
+    i = (i + 1) & (queue->index_size - 1);
+  }
+  queue->index[i] = (WaitingEntry){arrival_time, slot, recipe->id};
+  queue->index_n++;
+  queue->index_used++;
+}
+
+inline void waiting_index_delete(WaitingQueue *queue, WaitingEntry *entry) {
+  entry->arrival_time = INDEX_DELETED;
+  queue->index_n--;
+}
+
+// Point the entries of the recipe's waiting orders at their slots again.
+void waiting_index_renumber(WaitingQueue *queue, Recipe *recipe) {
+  WaitingBucket *bucket = &recipe->waiting;
+  for (int i = 0; i < bucket->n_arrivals; i++) {
+    WaitingEntry *entry = waiting_index_get(queue, bucket->arrivals[i]);
+    if (entry != NULL) {
+      entry->slot = i;
+    }
+  }
+}
+
+// Withdraw the waiting order that arrived at `arrival_time`. Returns false if
+// no such order is waiting.
+bool waiting_queue_cancel(WaitingQueue *queue, StockHT *stock_ht,
+                          int arrival_time) {
+  WaitingEntry *entry = waiting_index_get(queue, arrival_time);
+  Recipe *recipe;
+  if (entry != NULL) {
+    recipe = recipe_at(entry->recipe);
+    if (!waiting_bucket_cancel(&recipe->waiting, entry->slot)) {
+      return false;
+    }
+    waiting_index_delete(queue, entry);
+    queue->n_resident--;
+  } else {
+    int i = waiting_queue_cancel_spilled(queue, arrival_time);
+    if (i == -1) {
+      return false;
+    }
+    recipe = recipe_at(queue->spilled[i]);
+    if (--recipe->waiting.n_spilled == 0) {
+      waiting_queue_unspill(queue, recipe);
+    }
+  }
+  recipe->n_waiting_orders--;
+
+  if (recipe->waiting.n_live == 0 && recipe->waiting.n_spilled == 0) {
+    // Nothing left to wake up for, nor to check again: the recipe may be
+    // removed before the next restock
+    if (recipe->watching >= 0) {
+      recipe_unwatch(stock_ht, recipe);
+    } else if (recipe->watching == WATCH_PENDING) {
+      waiting_queue_unwake(queue, recipe);
+    }
+    recipe->min_amount = INT_MAX;
+  }
+  return true;
+}
+
+// Return the offset of a free slot of the spill file, creating the file on
+// first use, or -1 if there is none.
+long waiting_queue_claim_slot(WaitingQueue *queue) {
+  if (queue->n_free_slots > 0) {
+    return queue->free_slots[--queue->n_free_slots];
+  }
+  if (queue->spill_file == NULL) {
+    queue->spill_file = tmpfile();
+    if (queue->spill_file == NULL) {
+      return -1;
+    }
+  }
+  // Keep room for every slot in the free ones, so that releasing one cannot
+  // fail
+  int n_slots = queue->spill_end / SPILL_SLOT_SIZE;
+  if (n_slots == queue->free_slots_capacity) {
+    int capacity =
+        queue->free_slots_capacity == 0 ? 16 : 2 * queue->free_slots_capacity;
+    long *free_slots =
+        (long *)realloc(queue->free_slots, capacity * sizeof(long));
+    if (free_slots == NULL) {
+      return -1;
+    }
+    queue->free_slots = free_slots;
+    queue->free_slots_capacity = capacity;
+  }
+  long offset = queue->spill_end;
+  queue->spill_end += SPILL_SLOT_SIZE;
+#ifdef DEBUG
+  if (queue->spill_end > queue->spill_peak) {
+    queue->spill_peak = queue->spill_end;
+  }
+#endif
+  return offset;
+}
+
+void waiting_queue_release_slot(WaitingQueue *queue, long offset) {
+  queue->free_slots[queue->n_free_slots++] = offset;
+}
+
+// Write `n` records to the spill file at `offset`. Returns false if they
+// cannot be written.
+bool waiting_queue_write(WaitingQueue *queue, const SpillRecord *records,
+                         int n, long offset) {
+#if SPILL_RESIDENT_LIMIT > 0
+  ssize_t size = n * sizeof(SpillRecord);
+  return pwrite(fileno(queue->spill_file), records, size, offset) == size;
+#else
+  (void)queue;
+  (void)records;
+  (void)n;
+  (void)offset;
+  return false;
+#endif
+}
+
+// Make room for `n` more segments of the recipe's bucket, and for the recipe
+// in the spilled recipes if it has no spilled order yet.
+bool waiting_queue_reserve_spill(WaitingQueue *queue, Recipe *recipe, int n) {
+  WaitingBucket *bucket = &recipe->waiting;
+  if (bucket->n_segments + n > bucket->segments_capacity) {
+    int capacity = bucket->segments_capacity == 0 ? 4 : bucket->segments_capacity;
+    while (capacity < bucket->n_segments + n) {
+      capacity *= 2;
+    }
+    SpillSegment *segments = (SpillSegment *)realloc(
+        bucket->segments, capacity * sizeof(SpillSegment));
+    if (segments == NULL) {
+      return false;
+    }
+    bucket->segments = segments;
+    bucket->segments_capacity = capacity;
+  }
+  if (bucket->n_spilled == 0 && queue->n_spilled == queue->spilled_capacity) {
+    int capacity =
+        queue->spilled_capacity == 0 ? 16 : 2 * queue->spilled_capacity;
+    int *spilled = (int *)realloc(queue->spilled, capacity * sizeof(int));
+    if (spilled == NULL) {
+      return false;
+    }
+    queue->spilled = spilled;
+    queue->spilled_capacity = capacity;
+  }
+  return true;
+}
+
+int spill_record_arrival(const SpillRecord *record) {
+  return record->arrival_time >= 0 ? record->arrival_time
+                                   : ~record->arrival_time;
+}
+
+// Move the orders the recipe's bucket holds in memory to new segments of up
+// to SPILL_MIN_ORDERS each, after the ones already scanned by the running
+// restock (all before them) and in front of the others, and free its arrays.
+// Returns false, leaving the bucket and the file as they were, if the file
+// cannot be written.
+bool waiting_queue_spill(WaitingQueue *queue, Recipe *recipe) {
+  WaitingBucket *bucket = &recipe->waiting;
+  int n_new = (bucket->n_live + SPILL_MIN_ORDERS - 1) / SPILL_MIN_ORDERS;
+  if (n_new == 0 || !waiting_queue_reserve_spill(queue, recipe, n_new)) {
+    return false;
+  }
+  SpillSegment *segments = bucket->segments + bucket->n_scanned;
+  memmove(segments + n_new, segments,
+          (bucket->n_segments - bucket->n_scanned) * sizeof(SpillSegment));
+
+  // Written through a small buffer, in arrival order
+  SpillRecord buffer[1024];
+  int n_buffered = 0;
+  int n_claimed = 0;
+  int n = 0;
+  bool written = true;
+  for (int r = bucket->first_run; r < bucket->n_runs && written; r++) {
+    for (int i = bucket->run_firsts[r]; i < bucket->run_ends[r] && written;
+         i++) {
+      if (bucket->cancelled != NULL && bucket->cancelled[i]) {
+        continue;
+      }
+      SpillSegment *segment = &segments[n / SPILL_MIN_ORDERS];
+      if (n % SPILL_MIN_ORDERS == 0) {
+        long offset = waiting_queue_claim_slot(queue);
+        if (offset == -1) {
+          written = false;
+          break;
+        }
+        n_claimed++;
+        *segment = (SpillSegment){offset, 0, bucket->arrivals[i], 0};
+      }
+      segment->n++;
+      segment->last_arrival = bucket->arrivals[i];
+      buffer[n_buffered++] =
+          (SpillRecord){bucket->arrivals[i], bucket->run_amounts[r]};
+      if (++n == bucket->n_live || n % SPILL_MIN_ORDERS == 0 ||
+          n_buffered == 1024) {
+        // A buffered write never spans two segments
+        long offset = segment->offset +
+                      (segment->n - n_buffered) * (long)sizeof(SpillRecord);
+        written = waiting_queue_write(queue, buffer, n_buffered, offset);
+        n_buffered = 0;
+      }
+    }
+  }
+  if (!written) {
+    for (int k = 0; k < n_claimed; k++) {
+      waiting_queue_release_slot(queue, segments[k].offset);
+    }
+    memmove(segments, segments + n_new,
+            (bucket->n_segments - bucket->n_scanned) * sizeof(SpillSegment));
+    return false;
+  }
+
+  for (int r = bucket->first_run; r < bucket->n_runs; r++) {
+    for (int i = bucket->run_firsts[r]; i < bucket->run_ends[r]; i++) {
+      if (bucket->cancelled == NULL || !bucket->cancelled[i]) {
+        WaitingEntry *entry = waiting_index_get(queue, bucket->arrivals[i]);
+        if (entry != NULL) {
+          waiting_index_delete(queue, entry);
+        }
+      }
+    }
+  }
+  bucket->n_segments += n_new;
+  bucket->n_scanned += n_new;
+  if (bucket->n_spilled == 0) {
+    bucket->spilled_pos = queue->n_spilled;
+    queue->spilled[queue->n_spilled++] = recipe->id;
+  }
+  bucket->n_spilled += bucket->n_live;
+  queue->n_resident -= bucket->n_live;
+
+  // Give the memory back
+  free(bucket->arrivals);
+  free(bucket->cancelled);
+  free(bucket->run_amounts);
+  bucket->arrivals = NULL;
+  bucket->cancelled = NULL;
+  bucket->n_arrivals = 0;
+  bucket->arrivals_capacity = 0;
+  bucket->n_live = 0;
+  bucket->run_amounts = NULL;
+  bucket->run_firsts = NULL;
+  bucket->run_ends = NULL;
+  bucket->first_run = 0;
+  bucket->n_runs = 0;
+  bucket->n_live_runs = 0;
+  bucket->runs_capacity = 0;
+  return true;
+}
+
+// Queue an order of a recipe with spilled orders behind them, writing the
+// queued ones to a new segment first once SPILL_MIN_ORDERS are waiting.
+// Returns false if the order cannot be kept.
+bool waiting_queue_defer(WaitingQueue *queue, Recipe *recipe, int amount,
+                         int arrival_time) {
+  WaitingBucket *bucket = &recipe->waiting;
+  if (bucket->pending == NULL) {
+    bucket->pending =
+        (SpillRecord *)malloc(SPILL_MIN_ORDERS * sizeof(SpillRecord));
+    if (bucket->pending == NULL) {
+      return false;
+    }
+  }
+  if (bucket->n_pending == SPILL_MIN_ORDERS) {
+    if (!waiting_queue_reserve_spill(queue, recipe, 1)) {
+      return false;
+    }
+    long offset = waiting_queue_claim_slot(queue);
+    if (offset == -1) {
+      return false;
+    }
+    if (!waiting_queue_write(queue, bucket->pending, bucket->n_pending,
+                             offset)) {
+      waiting_queue_release_slot(queue, offset);
+      return false;
+    }
+    bucket->segments[bucket->n_segments++] = (SpillSegment){
+        offset, bucket->n_pending, spill_record_arrival(&bucket->pending[0]),
+        spill_record_arrival(&bucket->pending[bucket->n_pending - 1])};
+    bucket->n_pending = 0;
+  }
+  bucket->pending[bucket->n_pending++] = (SpillRecord){arrival_time, amount};
+  bucket->n_spilled++;
+  return true;
+}
+
+// Read the oldest spilled orders not scanned yet back into the recipe's
+// bucket, after the ones still in memory: the next segments up to one holding
+// a waiting order, streamed from the spill file, or else the orders not
+// written yet. The cursor is left on the first run they may start. Returns
+// false, leaving the bucket as it was, if they do not fit in memory.
+bool waiting_queue_load(WaitingQueue *queue, Recipe *recipe) {
+#if SPILL_RESIDENT_LIMIT > 0
+  WaitingBucket *bucket = &recipe->waiting;
+  if (bucket->n_live < bucket->n_arrivals) {
+    waiting_bucket_compact(bucket);
+    waiting_index_renumber(queue, recipe);
+  }
+  int n_arrivals = bucket->n_arrivals;
+  int n_runs = bucket->n_runs;
+  int n_live_runs = bucket->n_live_runs;
+  int last_end = n_runs > 0 ? bucket->run_ends[n_runs - 1] : 0;
+  long page_size = sysconf(_SC_PAGESIZE);
+  while (bucket->n_arrivals == n_arrivals &&
+         (bucket->n_segments > bucket->n_scanned || bucket->n_pending > 0)) {
+    const SpillRecord *records = bucket->pending;
+    int n = bucket->n_pending;
+    char *map = NULL;
+    size_t length = 0;
+    if (bucket->n_segments > bucket->n_scanned) {
+      SpillSegment *segment = &bucket->segments[bucket->n_scanned];
+      long start = segment->offset & ~(page_size - 1);
+      length = segment->offset + segment->n * sizeof(SpillRecord) - start;
+      map = (char *)mmap(NULL, length, PROT_READ, MAP_PRIVATE,
+                         fileno(queue->spill_file), start);
+      if (map == MAP_FAILED) {
+        return false;
+      }
+      madvise(map, length, MADV_SEQUENTIAL);
+      records = (const SpillRecord *)(map + (segment->offset - start));
+      n = segment->n;
+    }
+
+    // Room in the index for every order loaded so far and these
+    bool loaded =
+        waiting_index_reserve(queue, bucket->n_arrivals - n_arrivals + n);
+    for (int i = 0; i < n && loaded; i++) {
+      loaded = records[i].arrival_time < 0 ||
+               waiting_bucket_push(bucket, records[i].amount,
+                                   records[i].arrival_time);
+    }
+    if (map != NULL) {
+      munmap(map, length);
+    }
+    if (!loaded) {
+      // Drop what was pushed
+      bucket->n_live -= bucket->n_arrivals - n_arrivals;
+      bucket->n_arrivals = n_arrivals;
+      bucket->n_runs = n_runs;
+      bucket->n_live_runs = n_live_runs;
+      if (n_runs > 0) {
+        bucket->run_ends[n_runs - 1] = last_end;
+      }
+      return false;
+    }
+
+    if (bucket->n_segments > bucket->n_scanned) {
+      SpillSegment *segment = &bucket->segments[bucket->n_scanned];
+      waiting_queue_release_slot(queue, segment->offset);
+      memmove(segment, segment + 1,
+              (--bucket->n_segments - bucket->n_scanned) *
+                  sizeof(SpillSegment));
+    } else {
+      bucket->n_pending = 0;
     }
   }
 
-  free(ht->stocks);
-  ht->stocks = new_ht->stocks;
-  ht->size = new_ht->size;
-  ht->n_elements = new_ht->n_elements;
-  free(new_ht);
+  int n_loaded = bucket->n_arrivals - n_arrivals;
+  for (int i = n_arrivals; i < bucket->n_arrivals; i++) {
+    waiting_index_put(queue, bucket->arrivals[i], recipe, i);
+  }
+  bucket->n_spilled -= n_loaded;
+  queue->n_resident += n_loaded;
+  if (bucket->n_spilled == 0) {
+    waiting_queue_unspill(queue, recipe);
+  }
+  // Orders extending the last run failed with it
+  recipe->cursor = n_runs;
+  return true;
+#else
+  (void)queue;
+  (void)recipe;
+  return false;
+#endif
 }
 
-inline Stock *stock_get_or_create(StockHT *ht, char *name) {
-  Stock *stock = stock_ht_get(ht, name);
-  if (stock == NULL) {
-    stock = create_stock(name);
-    stock_ht_put(ht, stock);
+// Forget the recipe's spilled orders, which have all been loaded or
+// cancelled.
+void waiting_queue_unspill(WaitingQueue *queue, Recipe *recipe) {
+  WaitingBucket *bucket = &recipe->waiting;
+  Recipe *last = recipe_at(queue->spilled[--queue->n_spilled]);
+  queue->spilled[bucket->spilled_pos] = last->id;
+  last->waiting.spilled_pos = bucket->spilled_pos;
+  bucket->spilled_pos = -1;
+  // Segments left hold cancelled orders only
+  for (int k = 0; k < bucket->n_segments; k++) {
+    waiting_queue_release_slot(queue, bucket->segments[k].offset);
+  }
+  bucket->n_segments = 0;
+  bucket->n_spilled = 0;
+  free(bucket->pending);
+  bucket->pending = NULL;
+  bucket->n_pending = 0;
+  if (queue->n_spilled == 0) {
+    // Nothing in the file is needed anymore
+    queue->spill_end = 0;
+    queue->n_free_slots = 0;
+#if SPILL_RESIDENT_LIMIT > 0
+    if (ftruncate(fileno(queue->spill_file), 0) != 0) {
+      // Left to be overwritten
+    }
+#endif
   }
-  return stock;
 }
-// END STOCK IMPLEMENTATION ========================
 
-// ORDER IMPLEMENTATION ===============================
-struct Order {
-  Recipe *recipe;
-  int amount; // Number of orders
-  int arrival_time;
-  int total_weight;
-};
+// Flag the spilled order that arrived at `arrival_time` as cancelled, in the
+// spill file or among the orders not written yet. Each bucket's segments are
+// in arrival order, so only the one whose range holds it is searched. Returns
+// the position of its recipe in the spilled recipes, or -1 if no spilled order
+// arrived then.
+int waiting_queue_cancel_spilled(WaitingQueue *queue, int arrival_time) {
+#if SPILL_RESIDENT_LIMIT > 0
+  for (int p = 0; p < queue->n_spilled; p++) {
+    WaitingBucket *bucket = &recipe_at(queue->spilled[p])->waiting;
+    SpillRecord *records = bucket->pending;
+    int n = bucket->n_pending;
+    long offset = -1;
+    if (n == 0 || arrival_time < spill_record_arrival(&records[0])) {
+      // The last segment starting at or before it
+      int low = 0;
+      int high = bucket->n_segments;
+      while (low < high) {
+        int mid = low + (high - low) / 2;
+        if (bucket->segments[mid].first_arrival <= arrival_time) {
+          low = mid + 1;
+        } else {
+          high = mid;
+        }
+      }
+      if (low == 0 || arrival_time > bucket->segments[low - 1].last_arrival) {
+        continue;
+      }
+      offset = bucket->segments[low - 1].offset;
+      n = bucket->segments[low - 1].n;
+    }
 
-inline Order *create_order(Recipe *recipe, int amount, int arrival_time) {
-  Order *order = (Order *)malloc(sizeof(Order));
-  if (order == NULL) {
-    return NULL;
+    // Binary search on the arrival times, cancelled ones included
+    int fd = offset != -1 ? fileno(queue->spill_file) : -1;
+    int low = 0;
+    int high = n - 1;
+    while (low <= high) {
+      int mid = low + (high - low) / 2;
+      SpillRecord record;
+      if (offset == -1) {
+        record = records[mid];
+      } else if (pread(fd, &record, sizeof(SpillRecord),
+                       offset + mid * sizeof(SpillRecord)) !=
+                 sizeof(SpillRecord)) {
+        return -1;
+      }
+      int arrival = spill_record_arrival(&record);
+      if (arrival < arrival_time) {
+        low = mid + 1;
+      } else if (arrival > arrival_time) {
+        high = mid - 1;
+      } else if (record.arrival_time < 0) {
+        return -1;
+      } else if (offset == -1) {
+        records[mid].arrival_time = ~arrival_time;
+        return p;
+      } else {
+        record.arrival_time = ~arrival_time;
+        if (pwrite(fd, &record, sizeof(SpillRecord),
+                   offset + mid * sizeof(SpillRecord)) !=
+            sizeof(SpillRecord)) {
+          return -1;
+        }
+        return p;
+      }
+    }
   }
-
-  order->recipe = recipe;
-  order->amount = amount;
-  order->arrival_time = arrival_time;
-  order->total_weight = recipe->weight * amount;
-
-  return order;
+#else
+  (void)queue;
+  (void)arrival_time;
+#endif
+  return -1;
 }
 
-inline void free_order(Order *order) { free(order); }
-
-struct OrderNode {
-  Order *order;
-  OrderNode *next;
-};
-
-inline OrderNode *create_order_node(Order *order) {
-
-  OrderNode *node = (OrderNode *)malloc(sizeof(OrderNode));
-  if (node == NULL) {
-    return NULL;
+// Spill the recipe's bucket if too many waiting orders are in memory and it
+// holds enough of them to be worth it, or if the orders it holds arrived after
+// segments already scanned by the restock, and end the scan.
+void waiting_queue_relieve(WaitingQueue *queue, Recipe *recipe) {
+  WaitingBucket *bucket = &recipe->waiting;
+  if (bucket->n_scanned > 0 ||
+      (SPILL_RESIDENT_LIMIT > 0 && queue->n_resident > SPILL_RESIDENT_LIMIT &&
+       bucket->n_live >= SPILL_MIN_ORDERS)) {
+    waiting_queue_spill(queue, recipe);
   }
+  bucket->n_scanned = 0;
+}
 
-  node->order = order;
-  node->next = NULL;
+inline int waiting_heap_arrival(int id) {
+  Recipe *recipe = recipe_at(id);
+  WaitingBucket *bucket = &recipe->waiting;
+  return bucket->arrivals[bucket->run_firsts[recipe->cursor]];
+}
 
-  return node;
+void waiting_heap_sift_down(int *heap, int n, int i) {
+  int id = heap[i];
+  int arrival_time = waiting_heap_arrival(id);
+  while (2 * i + 1 < n) {
+    int child = 2 * i + 1;
+    if (child + 1 < n && waiting_heap_arrival(heap[child + 1]) <
+                             waiting_heap_arrival(heap[child])) {
+      child++;
+    }
+    if (waiting_heap_arrival(heap[child]) >= arrival_time) {
+      break;
+    }
+    heap[i] = heap[child];
+    i = child;
+  }
+  heap[i] = id;
 }
 
-inline void free_order_node(OrderNode *node) {
-  free_order(node->order);
-  free(node);
+#if PARALLEL_RESCAN > 0
+typedef struct {
+  const StockHT *stock_ht;
+  int *recipes;
+  RecipeCheck *checks;
+  int begin;
+  int end;
+} SpeculationSlice;
+
+void *waiting_queue_speculate_slice(void *arg) {
+  SpeculationSlice *slice = (SpeculationSlice *)arg;
+  for (int i = slice->begin; i < slice->end; i++) {
+    Recipe *recipe = recipe_at(slice->recipes[i]);
+    recipe_check(slice->stock_ht, recipe, recipe->min_amount,
+                 &slice->checks[i]);
+  }
+  return NULL;
 }
+#endif
+
+// Check the woken buckets at their smallest amount on PARALLEL_RESCAN threads,
+// against the stocks as they are at the end of the restock. The checks only
+// read the stocks and the recipes; waiting_queue_commit then applies them in
+// list order. Returns false, leaving the buckets to the serial checks, when
+// there are too few of them or memory runs out.
+bool waiting_queue_speculate(WaitingQueue *queue, StockHT *stock_ht) {
+#if PARALLEL_RESCAN > 0
+  int n = queue->n_speculated;
+  if (!queue->in_sync || n < PARALLEL_MIN_WOKEN) {
+    return false;
+  }
 
-struct OrderQueue {
-  OrderNode *head;
-  OrderNode *tail;
-};
+  if (stock_ht->n_ids > queue->touched_capacity) {
+    int *touched =
+        (int *)realloc(queue->touched, stock_ht->ids_capacity * sizeof(int));
+    if (touched == NULL) {
+      return false;
+    }
+    memset(touched + queue->touched_capacity, 0,
+           (stock_ht->ids_capacity - queue->touched_capacity) * sizeof(int));
+    queue->touched = touched;
+    queue->touched_capacity = stock_ht->ids_capacity;
+  }
 
-OrderQueue *create_order_queue() {
-  OrderQueue *queue = (OrderQueue *)malloc(sizeof(OrderQueue));
-  if (queue == NULL) {
-    return NULL;
+  // The calling thread takes the first slice, and those of the threads that
+  // could not be started
+  pthread_t threads[PARALLEL_RESCAN];
+  bool started[PARALLEL_RESCAN];
+  SpeculationSlice slices[PARALLEL_RESCAN];
+  for (int t = 0; t < PARALLEL_RESCAN; t++) {
+    slices[t] = (SpeculationSlice){stock_ht, queue->speculated, queue->checks,
+                                   (int)((long)n * t / PARALLEL_RESCAN),
+                                   (int)((long)n * (t + 1) / PARALLEL_RESCAN)};
+    started[t] = t > 0 && pthread_create(&threads[t], NULL,
+                                         waiting_queue_speculate_slice,
+                                         &slices[t]) == 0;
+  }
+  for (int t = 0; t < PARALLEL_RESCAN; t++) {
+    if (started[t]) {
+      pthread_join(threads[t], NULL);
+    } else {
+      waiting_queue_speculate_slice(&slices[t]);
+    }
   }
 
-  queue->head = NULL;
-  queue->tail = NULL;
-  return queue;
+  queue->stamp++;
+  queue->purged = false;
+  queue->empty_mask = stock_ht->empty_mask;
+  return true;
+#else
+  (void)queue;
+  (void)stock_ht;
+  return false;
+#endif
 }
 
-void free_order_queue(OrderQueue *queue) {
-  OrderNode *node = queue->head;
-  while (node != NULL) {
-    OrderNode *next = node->next;
-    free_order_node(node);
-    node = next;
+// Apply the speculative check of `recipe`, the k-th bucket of the woken list,
+// and return the stock ID missing for its smallest amount or -1. A check made
+// before an earlier bucket purged expired lots from one of its stocks, or
+// emptied a signature class, is made again.
+int waiting_queue_commit(WaitingQueue *queue, StockHT *stock_ht,
+                         Recipe *recipe, int k) {
+  // The list starts from the last bucket woken
+  int i = queue->n_speculated - 1 - k;
+  RecipeCheck *check = &queue->checks[i];
+#if PREFETCH_DISTANCE > 0
+  // The next buckets are taken from the woken list one pointer at a time, and
+  // their ingredients are read again to record a shortfall
+  if (i >= 2 * PREFETCH_DISTANCE) {
+    __builtin_prefetch(recipe_at(queue->speculated[i - 2 * PREFETCH_DISTANCE]),
+                       1);
   }
-  free(queue);
-}
-
-inline void order_queue_enqueue(OrderQueue *queue, OrderNode *node) {
-  if (queue->tail == NULL) {
-    queue->head = node;
-    queue->tail = node;
-    return;
+  if (i >= PREFETCH_DISTANCE) {
+    __builtin_prefetch(
+        recipe_at(queue->speculated[i - PREFETCH_DISTANCE])->ingredient_ids, 1);
+  }
+#endif
+  if (queue->purged) {
+    bool touched = stock_ht->empty_mask != queue->empty_mask;
+    for (int i = 0; i < recipe->n_ingredients && !touched; i++) {
+      touched = queue->touched[recipe->ingredient_ids[i]] == queue->stamp;
+    }
+    if (touched) {
+      recipe_check(stock_ht, recipe, recipe->min_amount, check);
+    }
   }
 
-  queue->tail->next = node;
-  queue->tail = node;
+  if (check->kind == CHECK_STALE) {
+    queue->purged = true;
+    for (int i = 0; i < recipe->n_ingredients; i++) {
+      queue->touched[recipe->ingredient_ids[i]] = queue->stamp;
+    }
+  }
+  return recipe_apply_check(stock_ht, recipe, recipe->min_amount, check);
 }
+// END WAITING IMPLEMENTATION ==========================
 
-inline void order_node_enqueue_by_weight(OrderNode **list, OrderNode *node) {
-  // Add node in decreasing order according to the weight in the list,
-  // if the weight is the same, order by arrival time
-  if (*list == NULL) {
-    *list = node;
-    return;
+// TRUCK IMPLEMENTATION ==============================
+
+// Insert the order by arrival time and return it. `after` is an earlier order
+// or -1: orders inserted in arrival order pass the previous one, and go right
+// after it if nothing arrived in between. Otherwise the search starts at the
+// last order of the previous non-empty block of the directory.
+int order_queue_enqueue_by_arrival_time(OrderQueue *queue, int after,
+                                        int id) {
+  Order *order = order_at(id);
+  int arrival_time = order->arrival_time;
+  bool marked = order_queue_reserve(queue, arrival_time);
+  if (marked) {
+    order_queue_mark(queue, id);
+  }
+  if (queue->tail == -1) {
+    queue->head = id;
+    queue->tail = id;
+    return id;
   }
 
-  OrderNode *curr = *list;
-  OrderNode *prev = NULL;
-  while (curr != NULL &&
-         curr->order->total_weight > node->order->total_weight) {
-    prev = curr;
-    curr = curr->next;
+  if (marked &&
+      (after == -1 || (order_at(after)->next != -1 &&
+                       order_at(order_at(after)->next)->arrival_time <
+                           arrival_time))) {
+    int block = order_queue_prev_block(queue, arrival_time >> TRUCK_BLOCK_BITS);
+    after = block == -1 ? -1 : queue->last[block];
   }
 
-  // Find the correct position to insert the node (by arrival time).
-  while (curr != NULL &&
-         curr->order->total_weight == node->order->total_weight &&
-         curr->order->arrival_time < node->order->arrival_time) {
+  // Find the correct position to insert the order (by arrival time).
+  int curr = after == -1 ? queue->head : order_at(after)->next;
+  int prev = after;
+  while (curr != -1 && order_at(curr)->arrival_time < arrival_time) {
     prev = curr;
-    curr = curr->next;
+    curr = order_at(curr)->next;
   }
 
-  if (prev == NULL) {
-    node->next = *list;
-    *list = node;
-    return;
+  if (prev == -1) {
+    order->next = queue->head;
+    queue->head = id;
+    return id;
   }
 
-  prev->next = node;
-  node->next = curr;
+  order_at(prev)->next = id;
+  order->next = curr;
+  if (curr == -1) {
+    queue->tail = id;
+  }
+  return id;
 }
-// END ORDER IMPLEMENTATION ===========================
-
-// TRUCK IMPLEMENTATION ==============================
 
-inline void order_queue_enqueue_by_arrival_time(OrderQueue *queue, OrderNode *node) {
-  if (queue->tail == NULL) {
-    queue->head = node;
-    queue->tail = node;
-    return;
+// Make room for a truck load of `n` orders. Returns false if it cannot.
+bool order_queue_reserve_load(OrderQueue *queue, int n) {
+  if (n <= queue->load_capacity) {
+    return true;
   }
-
-  // Find the correct position to insert the node (by arrival time).
-  OrderNode *curr = queue->head;
-  OrderNode *prev = NULL;
-  while (curr != NULL &&
-         curr->order->arrival_time < node->order->arrival_time) {
-    prev = curr;
-    curr = curr->next;
+  int capacity = queue->load_capacity == 0 ? 64 : queue->load_capacity;
+  while (capacity < n) {
+    capacity *= 2;
   }
+  int *load = (int *)realloc(queue->load, capacity * sizeof(int));
+  if (load == NULL) {
+    return false;
+  }
+  queue->load = load;
+  int *scratch = (int *)realloc(queue->load_scratch, capacity * sizeof(int));
+  if (scratch == NULL) {
+    return false;
+  }
+  queue->load_scratch = scratch;
+  queue->load_capacity = capacity;
+  return true;
+}
 
-  if (prev == NULL) {
-    node->next = queue->head;
-    queue->head = node;
+// Sort a truck load, given in arrival order, by decreasing weight. Both sorts
+// are stable, so orders of the same weight stay in arrival order: insertion
+// sort for small loads, otherwise a radix sort on the complemented weight,
+// one byte at a time and skipping the bytes all weights share.
+void sort_truck_load(int *ids, int *scratch, int n) {
+  if (n <= 32) {
+    for (int i = 1; i < n; i++) {
+      int id = ids[i];
+      int weight = order_at(id)->total_weight;
+      int j = i - 1;
+      while (j >= 0 && order_at(ids[j])->total_weight < weight) {
+        ids[j + 1] = ids[j];
+        j--;
+      }
+      ids[j + 1] = id;
+    }
     return;
   }
 
-  prev->next = node;
-  node->next = curr;
-  if (curr == NULL) {
-    queue->tail = node;
+  uint32_t first = ~(uint32_t)order_at(ids[0])->total_weight;
+  uint32_t differ = 0;
+  for (int i = 1; i < n; i++) {
+    differ |= ~(uint32_t)order_at(ids[i])->total_weight ^ first;
+  }
+  int *from = ids;
+  int *to = scratch;
+  for (int shift = 0; shift < 32; shift += 8) {
+    if (((differ >> shift) & 0xFF) == 0) {
+      continue;
+    }
+    int counts[256] = {0};
+    for (int i = 0; i < n; i++) {
+      counts[(~(uint32_t)order_at(from[i])->total_weight >> shift) & 0xFF]++;
+    }
+    int position = 0;
+    for (int d = 0; d < 256; d++) {
+      int count = counts[d];
+      counts[d] = position;
+      position += count;
+    }
+    for (int i = 0; i < n; i++) {
+      uint32_t key = ~(uint32_t)order_at(from[i])->total_weight;
+      to[counts[(key >> shift) & 0xFF]++] = from[i];
+    }
+    int *swap = from;
+    from = to;
+    to = swap;
+  }
+  if (from != ids) {
+    memcpy(ids, from, n * sizeof(int));
   }
 }
 
-void order_queue_dequeue(OrderQueue *queue) {
-  if (queue->head == NULL) {
+void order_queue_dequeue(OrderQueue *queue, int capacity) {
+  if (queue->head == -1) {
     printf("camioncino vuoto\n");
     return;
   }
 
-  // Remove order from the list until the truck is full (TRUCK_WEIGHT)
-  OrderNode *node = queue->head;
+  // Take orders from the head until the truck is full, gathering them for
+  // the sort on the way
+  int id = queue->head;
   int tmp_weight = 0;
   int n_orders = 0;
-  OrderNode *orders = NULL;
-
-  while (node != NULL &&
-         tmp_weight + node->order->total_weight <= TRUCK_WEIGHT) {
-    tmp_weight += node->order->total_weight;
+  bool gathered = true;
+  while (id != -1 && tmp_weight + order_at(id)->total_weight <= capacity) {
+    tmp_weight += order_at(id)->total_weight;
+    if (gathered && (n_orders < queue->load_capacity ||
+                     order_queue_reserve_load(queue, n_orders + 1))) {
+      queue->load[n_orders] = id;
+    } else {
+      gathered = false;
+    }
     n_orders++;
-
-    OrderNode *next = node->next;
-    node->next = NULL;
-    order_node_enqueue_by_weight(&orders, node);
-    node = next;
+    order_queue_unmark(queue, id);
+    id = order_at(id)->next;
   }
 
   if (n_orders == 0) {
@@ -766,26 +3355,42 @@ void order_queue_dequeue(OrderQueue *queue) {
     return;
   }
 
-  OrderNode *curr_order = orders;
+  // Relink them by decreasing weight, then arrival time
+  int orders = -1;
+  if (gathered) {
+    sort_truck_load(queue->load, queue->load_scratch, n_orders);
+    for (int i = n_orders - 1; i >= 0; i--) {
+      order_at(queue->load[i])->next = orders;
+      orders = queue->load[i];
+    }
+  } else {
+    int curr = queue->head;
+    while (curr != id) {
+      int next = order_at(curr)->next;
+      order_at(curr)->next = -1;
+      order_enqueue_by_weight(&orders, curr);
+      curr = next;
+    }
+  }
+
+  int curr = orders;
   for (int i = 0; i < n_orders; i++) {
-    printf("%d %s %d\n", curr_order->order->arrival_time,
-           curr_order->order->recipe->name, curr_order->order->amount);
-    curr_order->order->recipe->n_waiting_orders--;
-    OrderNode *next = curr_order->next;
-    free_order_node(curr_order);
-    curr_order = next;
+    Order *order = order_at(curr);
+    Recipe *recipe = recipe_at(order->recipe);
+    printf("%d %s %d\n", order->arrival_time, recipe->info->name,
+           order->amount);
+    recipe->n_waiting_orders--;
+    int next = order->next;
+    free_order(curr);
+    curr = next;
   }
 
-  queue->head = node;
-  // If the queue is now empty, update the tail to NULL
-  if (queue->head == NULL) {
-    queue->tail = NULL;
+  queue->head = id;
+  // If the queue is now empty, update the tail too
+  if (queue->head == -1) {
+    queue->tail = -1;
   }
 }
-
-void set_truck_time(int time) { TRUCK_TIME = time; }
-
-void set_truck_weight(int weight) { TRUCK_WEIGHT = weight; }
 // END TRUCK IMPLEMENTATION =========================
 
 // UTIL IMPLEMENTATION ==============================
@@ -817,18 +3422,14 @@ inline uint32_t fnv1a_hash_string(const char *str, int size) {
 }
 
 
-inline char *read_line(FILE *stream) {
-  char *line = NULL;
-  size_t len = 0;
-  ssize_t nread;
-
-  nread = getline(&line, &len, stream);
-
+// Read the next line into `*buffer`, which is reused and grown as needed.
+inline char *read_line(FILE *stream, char **buffer, size_t *size) {
+  ssize_t nread = getline(buffer, size, stream);
   if (nread == -1) {
-    free(line);
     return NULL;
   }
 
+  char *line = *buffer;
   if (nread > 0 && line[nread - 1] == '\n') {
     line[nread - 1] = '\0';
   }
@@ -836,7 +3437,7 @@ inline char *read_line(FILE *stream) {
   return line;
 }
 
-void add_recipe(RecipeHT *ht, char *line) {
+void add_recipe(RecipeHT *ht, StockHT *stock_ht, char *line) {
   char *command = strtok(line, " ");
   if (command == NULL) {
     return;
@@ -852,19 +3453,27 @@ void add_recipe(RecipeHT *ht, char *line) {
     return;
   }
 
-  Recipe *recipe = create_recipe(recipe_name);
+  Recipe *recipe = create_recipe(ht->arena, recipe_name);
+  if (recipe == NULL) {
+    return;
+  }
   char *ingredient_name;
   while ((ingredient_name = strtok(NULL, " ")) != NULL) {
     char *ingredient_quantity = strtok(NULL, " ");
     if (ingredient_quantity == NULL) {
+      free_recipe(ht->arena, recipe);
       return;
     }
 
     // Add ingredient to the StockHT
-    recipe_add_ingredient(
-        recipe,
-        create_recipe_ingredient(ingredient_name, atoi(ingredient_quantity)));
+    Stock *stock = stock_get_or_create(stock_ht, ingredient_name);
+    if (stock == NULL ||
+        !recipe_add_ingredient(recipe, stock->id, atoi(ingredient_quantity))) {
+      free_recipe(ht->arena, recipe);
+      return;
+    }
   }
+  recipe->info->has_duplicates = recipe_has_duplicates(ht, recipe);
 
   recipe_ht_put(ht, recipe);
   printf("aggiunta\n");
@@ -883,292 +3492,550 @@ void remove_recipe(RecipeHT *ht, char *line) {
   recipe_ht_delete(ht, name);
 }
 
-void handle_stock(StockHT *stock_ht, char *line, OrderQueue *waiting_queue,
+int compare_stock_lots(const void *a, const void *b) {
+  const StockLot *lot_a = (const StockLot *)a;
+  const StockLot *lot_b = (const StockLot *)b;
+  return (lot_a->expiration_date > lot_b->expiration_date) -
+         (lot_a->expiration_date < lot_b->expiration_date);
+}
+
+// Sort lots by expiration date. Lots of one ingredient in one restock are few
+// and usually already in order, so insertion sort handles the common case.
+void sort_stock_lots(StockLot *lots, int n) {
+  if (n > 32) {
+    qsort(lots, n, sizeof(StockLot), compare_stock_lots);
+    return;
+  }
+
+  for (int i = 1; i < n; i++) {
+    StockLot lot = lots[i];
+    int j = i - 1;
+    while (j >= 0 && lots[j].expiration_date > lot.expiration_date) {
+      lots[j + 1] = lots[j];
+      j--;
+    }
+    lots[j + 1] = lot;
+  }
+}
+
+void handle_stock(StockHT *stock_ht, char *line, WaitingQueue *waiting_queue,
                   OrderQueue *truck_queue) {
+  // Every lot takes three tokens
+  int max_lots = 1;
+  for (char *c = line; *c != '\0'; c++) {
+    if (*c == ' ') {
+      max_lots++;
+    }
+  }
+  max_lots = max_lots / 3 + 1;
+
   char *command = strtok(line, " ");
   if (command == NULL) {
     return;
   }
+
+  int table_size = 2;
+  while (table_size < 2 * max_lots) {
+    table_size *= 2;
+  }
+
+  // Parsed lots, the same lots grouped by ingredient, and the scratch
+  // arrays used to group them.
+  if (!stock_ht_reserve_lots(stock_ht, max_lots)) {
+    return;
+  }
+  StockLot *lots = stock_ht->lots;
+  int *table = stock_ht->lot_table;
+  StockLot *grouped = lots + max_lots;
+  int *lot_groups = table + table_size;
+  int *group_heads = lot_groups + max_lots;
+  int *group_offsets = group_heads + max_lots;
+
+  int n_lots = 0;
+  bool complete = true;
   char *stock_name;
   while ((stock_name = strtok(NULL, " ")) != NULL) {
     char *quantity_str = strtok(NULL, " ");
     if (quantity_str == NULL) {
-      return;
+      complete = false;
+      break;
     }
-    int quantity = atoi(quantity_str);
 
     char *expiration_date_str = strtok(NULL, " ");
     if (expiration_date_str == NULL) {
-      return;
+      complete = false;
+      break;
+    }
+
+    lots[n_lots].name = stock_name;
+    lots[n_lots].quantity = atoi(quantity_str);
+    lots[n_lots].expiration_date = atoi(expiration_date_str);
+    n_lots++;
+  }
+
+  // Number the distinct ingredients of the line with a small hash table
+  // local to this call, then bucket the lots by ingredient (counting sort,
+  // so the order inside a group is the line order).
+  for (int i = 0; i < table_size; i++) {
+    table[i] = -1;
+  }
+  int n_groups = 0;
+  for (int i = 0; i < n_lots; i++) {
+    uint32_t hash = fnv1a_hash_string(lots[i].name, table_size);
+    while (table[hash] != -1 &&
+           strcmp(lots[group_heads[table[hash]]].name, lots[i].name) != 0) {
+      hash = (hash + 1) & (table_size - 1);
     }
-    int expiration_date = atoi(expiration_date_str);
+    if (table[hash] == -1) {
+      table[hash] = n_groups;
+      group_heads[n_groups] = i;
+      group_offsets[n_groups] = 0;
+      n_groups++;
+    }
+    lot_groups[i] = table[hash];
+    group_offsets[table[hash]]++;
+  }
 
-    StockIngredient *ingredient =
-        create_stock_ingredient(quantity, expiration_date);
+  int offset = 0;
+  for (int g = 0; g < n_groups; g++) {
+    int count = group_offsets[g];
+    group_offsets[g] = offset;
+    offset += count;
+  }
+  group_offsets[n_groups] = offset;
+  for (int i = 0; i < n_lots; i++) {
+    grouped[group_offsets[lot_groups[i]]++] = lots[i];
+  }
 
-    Stock *stock = stock_get_or_create(stock_ht, stock_name);
+  // Each ingredient is looked up once and its lots are merged in one pass.
+  int start = 0;
+  for (int g = 0; g < n_groups; g++) {
+    int end = group_offsets[g];
+    sort_stock_lots(grouped + start, end - start);
 
+    Stock *stock = stock_get_or_create(stock_ht, grouped[start].name);
     if (stock == NULL) {
-      return;
+      complete = false;
+      break;
     }
-    stock_add_ingredient(stock, ingredient);
+    if (!stock_add_ingredients(stock_ht, stock, grouped + start,
+                               end - start)) {
+      complete = false;
+      break;
+    }
+    waiting_queue_wake(waiting_queue, stock_ht, stock->id);
+    start = end;
+  }
+  RESTOCK_EPOCH++;
+
+  if (!complete) {
+    return;
   }
 
   printf("rifornito\n");
   check_waiting_orders(waiting_queue, truck_queue, stock_ht);
 }
 
-inline bool try_send_order(StockHT *stock_ht, OrderQueue *waiting_queue,
-                    OrderQueue *truck_queue, Order *order,
-                    bool is_waiting_order) {
-  if (!is_waiting_order) {
-    order->recipe->n_waiting_orders++;
-  }
+// Send a new order of `amount` units of the recipe, or make it wait. It is
+// only created as an Order once sent.
+inline bool try_send_order(WaitingQueue *waiting_queue, StockHT *stock_ht,
+                           OrderQueue *truck_queue, Recipe *recipe, int amount,
+                           int arrival_time) {
+  recipe->n_waiting_orders++;
 
-  Stock *stocks[order->recipe->n_ingredients];
-  bool missing_ingredients_flag =
-      check_missing_ingredients(stock_ht, order, stocks);
+  int missing_id = find_missing_ingredient(stock_ht, recipe, amount);
 
-  if (!missing_ingredients_flag) {
-    send_order(stock_ht, order, is_waiting_order, truck_queue, stocks);
+  if (missing_id == -1) {
+    send_order(stock_ht, recipe, amount, arrival_time, truck_queue);
     return true;
-  } else {
-    // If not from the waiting queue, we should enqueue the order in the
-    // waiting
-    if (!is_waiting_order) {
-      order_queue_enqueue(waiting_queue, create_order_node(order));
-    }
-    return false;
   }
+  waiting_queue_add(waiting_queue, stock_ht, recipe, amount, arrival_time,
+                    missing_id);
   return false;
 }
 
-inline void send_order(StockHT *stock_ht, Order *order, bool is_waiting_order,
-                OrderQueue *truck_queue, Stock **stocks) {
+// Send a new order: it arrived last, so it goes at the end of the truck queue
+inline void send_order(StockHT *stock_ht, Recipe *recipe, int amount,
+                       int arrival_time, OrderQueue *truck_queue) {
   // Remove the ingredients from the stock
-  RecipeIngredient *ingredient = order->recipe->ingredients;
-  int i = 0;
-  while (ingredient != NULL) {
-    stock_remove_ingredient(stocks[i++], ingredient->quantity * order->amount);
-    ingredient = ingredient->next;
-  }
-
-  OrderNode *node = create_order_node(order);
-  if (node == NULL) {
-    return;
+  for (int i = 0; i < recipe->n_ingredients; i++) {
+    Stock *stock = &stock_ht->stocks[recipe->ingredient_ids[i]];
+    stock_remove_ingredient(stock_ht, stock, recipe->quantities[i] * amount);
   }
 
-  // If the order was arrived from the waiting queue, we should enqueue
-  // the order in the truck queue in the right position (by arrival time)
-  // (O(n))
-  if (is_waiting_order) {
-    order_queue_enqueue_by_arrival_time(truck_queue, node);
-  } else {
-    // Otherwise, we should enqueue the order in the truck queue at the end
-    // (O(1))
-    order_queue_enqueue(truck_queue, node);
+  int id = create_order(recipe, amount, arrival_time);
+  if (id != -1) {
+    order_queue_enqueue(truck_queue, id);
   }
 }
 
-// Check if all ingredients are available
-bool check_missing_ingredients(StockHT *stock_ht, Order *order,
-                               Stock **stocks) {
-  bool missing_ingredients_flag = false;
-  int i = 0;
-  RecipeIngredient *ingredient = order->recipe->ingredients;
-  while (ingredient != NULL) {
-    Stock *stock = stock_ht_get(stock_ht, ingredient->name);
-
-    if (stock != NULL) {
-      stock_remove_expired_ingredients(stock, CURR_TIME);
+// Return how many orders of `amount` units of the recipe the stocks can
+// fulfil one after the other, up to `limit`. The levels must be exact, as
+// they are right after find_missing_ingredient found the recipe available.
+// An ingredient listed more than once is checked against its largest
+// quantity but consumed for the sum of them.
+int recipe_count_fits(StockHT *stock_ht, Recipe *recipe, int amount,
+                      int limit) {
+  int count = limit;
+  for (int i = 0; i < recipe->n_ingredients; i++) {
+    int id = recipe->ingredient_ids[i];
+    int max_quantity = recipe->quantities[i];
+    int sum_quantity = recipe->quantities[i];
+    if (recipe->info->has_duplicates) {
+      for (int j = 0; j < recipe->n_ingredients; j++) {
+        if (j != i && recipe->ingredient_ids[j] == id) {
+          sum_quantity += recipe->quantities[j];
+          if (recipe->quantities[j] > max_quantity) {
+            max_quantity = recipe->quantities[j];
+          }
+        }
+      }
     }
 
-    if (stock == NULL ||
-        ingredient->quantity * order->amount > stock->total_quantity) {
-      missing_ingredients_flag = true;
-      break;
+    int consumed = sum_quantity * amount;
+    if (consumed > 0) {
+      int fits =
+          (stock_ht->levels[id].total - max_quantity * amount) / consumed + 1;
+      if (fits < count) {
+        count = fits;
+      }
     }
-
-    stocks[i++] = stock;
-    ingredient = ingredient->next;
   }
-  return missing_ingredients_flag;
+  return count;
 }
 
-struct OrderCacheHT {
-  OrderNode **buckets;
-  int size;
-  int n_elements;
-};
-
-double order_cache_ht_load_factor(OrderCacheHT *cache) {
-  return (double)cache->n_elements / cache->size;
-}
+// Send as many of the waiting orders in the first `limit` slots of run `r` of
+// the recipe's bucket as the stocks allow. The lots are consumed once for the
+// whole batch, which drains them exactly as one order at a time would.
+// The orders are inserted in the truck queue by arrival time, each search
+// starting from the previous one: `prev` is the last order inserted by the
+// caller, if earlier, or -1, and the last order inserted here is returned.
+int send_order_run(WaitingQueue *queue, StockHT *stock_ht, Recipe *recipe,
+                   int r, int limit, OrderQueue *truck_queue, int prev) {
+  WaitingBucket *bucket = &recipe->waiting;
+  int amount = bucket->run_amounts[r];
+  int count = recipe_count_fits(stock_ht, recipe, amount, limit);
+  int end = bucket->run_firsts[r] + limit;
+  int sent = 0;
+  int i = bucket->run_firsts[r];
+  for (; i < end && sent < count; i++) {
+    if (bucket->cancelled != NULL && bucket->cancelled[i]) {
+      continue;
+    }
+    WaitingEntry *entry = waiting_index_get(queue, bucket->arrivals[i]);
+    if (entry != NULL) {
+      waiting_index_delete(queue, entry);
+    }
+    sent++;
 
-OrderCacheHT *create_order_cache_ht(int size) {
-  OrderCacheHT *cache = (OrderCacheHT *)malloc(sizeof(OrderCacheHT));
-  if (cache == NULL) {
-    return NULL;
+    int id = create_order(recipe, amount, bucket->arrivals[i]);
+    if (id == -1) {
+      continue;
+    }
+    prev = order_queue_enqueue_by_arrival_time(truck_queue, prev, id);
   }
 
-  cache->size = size;
-  cache->n_elements = 0;
-  cache->buckets = (OrderNode **)malloc(cache->size * sizeof(OrderNode *));
-  if (cache->buckets == NULL) {
-    return NULL;
+  for (int j = 0; j < recipe->n_ingredients; j++) {
+    Stock *stock = &stock_ht->stocks[recipe->ingredient_ids[j]];
+    stock_remove_ingredient(stock_ht, stock,
+                            recipe->quantities[j] * amount * sent);
   }
-  for (int i = 0; i < cache->size; i++) {
-    cache->buckets[i] = NULL;
+  bucket->run_firsts[r] = i;
+  bucket->n_live -= sent;
+  queue->n_resident -= sent;
+  if (i == bucket->run_ends[r]) {
+    bucket->n_live_runs--;
+  } else {
+    waiting_bucket_skip_cancelled(bucket, r);
   }
-
-  return cache;
+  return prev;
 }
 
-void order_cache_ht_add(OrderCacheHT *cache, OrderNode *node) {
-  uint32_t hash = fnv1a_hash_string(node->order->recipe->name, cache->size);
-  OrderNode *curr_node = cache->buckets[hash];
-  OrderNode *prev_node = NULL;
+// Check `amount` units of the recipe without changing the recipe or the
+// stocks, so that several checks can run at once. Amounts at least as large as
+// one already found short since the last restock are answered from the
+// recipe's blocked amount, and recipes needing an empty stock from their
+// signature, without looking at the stocks.
+void recipe_check(const StockHT *stock_ht, Recipe *recipe, int amount,
+                  RecipeCheck *check) {
+  if (recipe->blocked_epoch == RESTOCK_EPOCH &&
+      amount >= recipe->blocked_amount) {
+    check->kind = CHECK_CACHED;
+    return;
+  }
 
-  while (curr_node != NULL) {
-    // Check if a node with the same recipe name already exists
-    if (strcmp(curr_node->order->recipe->name, node->order->recipe->name) ==
-        0) {
-      if (curr_node->order->amount > node->order->amount) {
-        // Replace the existing node if the new one has a lesser amount
-        if (prev_node == NULL) {
-          cache->buckets[hash] = node;
-        } else {
-          prev_node->next = node;
-        }
-        node->next = curr_node->next;
-        free(curr_node); // Free the old node
-        cache->n_elements++;
+  // One AND rejects a recipe needing a stock from an all-empty class
+  uint64_t empty = recipe->signature & stock_ht->empty_mask;
+  if (empty != 0 && amount > 0) {
+    int bit = __builtin_ctzll(empty);
+    for (int i = 0; i < recipe->n_ingredients; i++) {
+      if (recipe->ingredient_ids[i] % SIGNATURE_BITS == bit &&
+          recipe->quantities[i] > 0) {
+        check->kind = CHECK_SIGNATURE;
+        check->index = i;
+        return;
       }
-      return;
     }
-    prev_node = curr_node;
-    curr_node = curr_node->next;
   }
 
-  // If no existing node with the same recipe name was found, add the new node
-  if (prev_node == NULL) {
-    // No nodes in the bucket, just add the new node
-    cache->buckets[hash] = node;
+  bool stale;
+  check->index = recipe_first_missing(recipe, stock_ht->levels, amount,
+                                      CURR_TIME, &stale);
+  if (check->index != -1) {
+    check->kind = CHECK_SHORT;
   } else {
-    // Add the new node at the end of the list
-    prev_node->next = node;
-  }
-  node->next = NULL;
-  cache->n_elements++;
-
-  // Check if resizing the hash table is needed
-  if (order_cache_ht_load_factor(cache) >= HT_LOAD_FACTOR) {
-    order_cache_ht_resize(cache);
+    check->kind = stale ? CHECK_STALE : CHECK_FIT;
   }
 }
 
-bool order_cache_ht_contains(OrderCacheHT *cache, OrderNode *node) {
-  uint32_t hash = fnv1a_hash_string(node->order->recipe->name, cache->size);
-  OrderNode *curr_node = cache->buckets[hash];
+// Record the outcome of a check of `amount` units of the recipe and return
+// the stock ID of an ingredient that is not available, or -1 if all of them
+// are. A fit against levels still counting expired lots is only final once
+// those lots are removed.
+int recipe_apply_check(StockHT *stock_ht, Recipe *recipe, int amount,
+                       const RecipeCheck *check) {
+  if (check->kind == CHECK_CACHED) {
+    return recipe->blocked_id;
+  }
+  if (check->kind == CHECK_SIGNATURE) {
+    int id = recipe->ingredient_ids[check->index];
+    recipe_set_blocked(recipe, amount, id);
+    return id;
+  }
 
-  if (curr_node == NULL) {
-    return false;
+#ifdef DEBUG
+  STATS_CHECKS++;
+  STATS_INGREDIENTS_CHECKED += check->kind == CHECK_SHORT
+                                   ? check->index + 1
+                                   : recipe->n_ingredients;
+#endif
+  if (check->kind == CHECK_SHORT) {
+    int id = recipe->ingredient_ids[check->index];
+    recipe_set_blocked(recipe, amount, id);
+    recipe_note_shortfall(stock_ht, recipe, check->index);
+    return id;
+  }
+  if (check->kind == CHECK_FIT) {
+    return -1;
   }
 
-  while (curr_node != NULL) {
-    if (strcmp(curr_node->order->recipe->name, node->order->recipe->name) ==
-            0 &&
-        curr_node->order->amount >= node->order->amount) {
-      return true;
+  for (int i = 0; i < recipe->n_ingredients; i++) {
+    int id = recipe->ingredient_ids[i];
+    if (stock_ht->levels[id].next_expiry <= CURR_TIME) {
+      stock_remove_expired_ingredients(stock_ht, &stock_ht->stocks[id],
+                                       CURR_TIME);
+    }
+    if (recipe->quantities[i] * amount > stock_ht->levels[id].total) {
+      recipe_set_blocked(recipe, amount, id);
+      recipe_note_shortfall(stock_ht, recipe, i);
+      return id;
     }
-    curr_node = curr_node->next;
   }
-
-  return false;
+  return -1;
 }
 
-void order_cache_ht_resize(OrderCacheHT *cache) {
-  OrderCacheHT *new_cache = create_order_cache_ht(cache->size * 2);
+// Return the stock ID of an ingredient that is not available for `amount`
+// units of the recipe, or -1 if all of them are.
+int find_missing_ingredient(StockHT *stock_ht, Recipe *recipe, int amount) {
+  RecipeCheck check;
+  recipe_check(stock_ht, recipe, amount, &check);
+  return recipe_apply_check(stock_ht, recipe, amount, &check);
+}
 
-  for (int i = 0; i < cache->size; i++) {
-    OrderNode *node = cache->buckets[i];
-    while (node != NULL) {
-      OrderNode *next = node->next;
-      node->next = NULL;
-      order_cache_ht_add(new_cache, node);
-      node = next;
+// Count a shortfall of the recipe's i-th ingredient and move it ahead of the
+// ingredients that have blocked less often, so that each recipe converges to
+// checking its likeliest shortfall first. Only the check order changes: the
+// stocks are independent, so consuming them in any order drains the same lots.
+// Halving the counts keeps them bounded and weighs recent shortfalls more, so
+// the order still adapts on a long run.
+void recipe_note_shortfall(StockHT *stock_ht, Recipe *recipe, int i) {
+  unsigned *shortfalls = stock_ht->shortfalls;
+  int id = recipe->ingredient_ids[i];
+  if (++shortfalls[id] == SHORTFALL_HALVING) {
+    for (int s = 0; s < stock_ht->n_ids; s++) {
+      shortfalls[s] >>= 1;
     }
   }
-
-  free(cache->buckets);
-  cache->buckets = new_cache->buckets;
-  cache->size = new_cache->size;
-  cache->n_elements = new_cache->n_elements;
-  free(new_cache);
+#if ADAPTIVE_CHECK_ORDER
+  int quantity = recipe->quantities[i];
+  while (i > 0 && shortfalls[recipe->ingredient_ids[i - 1]] < shortfalls[id]) {
+    recipe->ingredient_ids[i] = recipe->ingredient_ids[i - 1];
+    recipe->quantities[i] = recipe->quantities[i - 1];
+    i--;
+  }
+  recipe->ingredient_ids[i] = id;
+  recipe->quantities[i] = quantity;
+#endif
 }
 
-void free_order_cache_ht(OrderCacheHT *cache) {
-  for (int i = 0; i < cache->size; i++) {
-    OrderNode *node = cache->buckets[i];
-    while (node != NULL) {
-      OrderNode *next = node->next;
-      free(node);
-      node = next;
-    }
+void recipe_set_blocked(Recipe *recipe, int amount, int id) {
+  // A cached amount is only ever replaced by a smaller one in the same epoch
+  if (recipe->blocked_epoch != RESTOCK_EPOCH ||
+      amount < recipe->blocked_amount) {
+    recipe->blocked_epoch = RESTOCK_EPOCH;
+    recipe->blocked_amount = amount;
+    recipe->blocked_id = id;
   }
-
-  free(cache->buckets);
-  free(cache);
 }
 
-inline void check_waiting_orders(OrderQueue *waiting_queue, OrderQueue *truck_queue,
+// Check again the buckets woken up by a restock. A bucket still blocked at its
+// smallest amount stays blocked as a whole; the others are merged through the
+// heap, so their orders are checked in arrival order as in a single queue.
+// Many woken buckets are first checked in parallel, see
+// waiting_queue_speculate.
+void check_waiting_orders(WaitingQueue *queue, OrderQueue *truck_queue,
                           StockHT *stock_ht) {
-  OrderNode *node = waiting_queue->head;
-  OrderNode *prev_node = NULL;
-
-  // Initialize the cache
-  // OrderCacheHT *cache = create_order_cache_ht(HT_INIT_SIZE_RECIPE);
-
-  // && node->order->arrival_time <= CURR_TIME) {
-  while (node != NULL) {
-
-    // if (order_cache_ht_contains(cache, create_order_node(node->order))) {
-    //   prev_node = node;
-    //   node = node->next;
-    //   continue;
-    // }
-
-    bool sent =
-        try_send_order(stock_ht, waiting_queue, truck_queue, node->order, true);
-
-    OrderNode *next = node->next;
-
-    if (sent) {
-      if (prev_node == NULL) {
-        // Node is the head
-        waiting_queue->head = next;
-      } else {
-        prev_node->next = next;
+  bool speculated = waiting_queue_speculate(queue, stock_ht);
+  int n = 0;
+  int k = 0;
+  int next = queue->woken;
+  queue->woken = -1;
+  while (next != -1) {
+    Recipe *recipe = recipe_at(next);
+    next = recipe->watch_next;
+    if (recipe->waiting.n_live == 0 && recipe->waiting.n_spilled == 0) {
+      // Every order left pending was cancelled
+      recipe->watching = WATCH_NONE;
+      recipe->min_amount = INT_MAX;
+      k++;
+      continue;
+    }
+    int missing_id =
+        speculated
+            ? waiting_queue_commit(queue, stock_ht, recipe, k++)
+            : find_missing_ingredient(stock_ht, recipe, recipe->min_amount);
+    if (missing_id != -1) {
+      recipe_watch(stock_ht, recipe, missing_id);
+    } else {
+      if (recipe->waiting.n_live == 0 && !waiting_queue_load(queue, recipe)) {
+        // Left pending until the next restock
+        waiting_queue_push_woken(queue, recipe);
+        continue;
       }
-
-      if (next == NULL) {
-        // Node is the tail
-        waiting_queue->tail = prev_node;
+      if (n == queue->heap_capacity) {
+        int capacity = queue->heap_capacity == 0 ? 16 : 2 * queue->heap_capacity;
+        int *heap = (int *)realloc(queue->heap, capacity * sizeof(int));
+        if (heap == NULL) {
+          // Left pending until the next restock
+          waiting_queue_push_woken(queue, recipe);
+          continue;
+        }
+        queue->heap = heap;
+        queue->heap_capacity = capacity;
       }
+      recipe->watching = WATCH_NONE;
+      recipe->cursor =
+          waiting_bucket_next_run(&recipe->waiting, recipe->waiting.first_run);
+      recipe->scan_min = INT_MAX;
+      queue->heap[n++] = recipe->id;
+    }
+  }
+  // Only the buckets left pending are still woken
+  queue->n_speculated = 0;
+  queue->in_sync = queue->woken == -1;
+  for (int i = n / 2 - 1; i >= 0; i--) {
+    waiting_heap_sift_down(queue->heap, n, i);
+  }
 
-      free(node);
+  // Orders leave in arrival order, so each one goes in the truck queue after
+  // the previous one
+  int truck_prev = -1;
+
+  while (n > 0) {
+    Recipe *recipe = recipe_at(queue->heap[0]);
+    WaitingBucket *bucket = &recipe->waiting;
+    int r = recipe->cursor;
+    int amount = bucket->run_amounts[r];
+#if PREFETCH_DISTANCE > 0
+    // The runs themselves are read sequentially; their arrival times are not
+    if (r + PREFETCH_DISTANCE < bucket->n_runs) {
+      __builtin_prefetch(bucket->arrivals +
+                         bucket->run_firsts[r + PREFETCH_DISTANCE]);
+    }
+#endif
+
+    if (find_missing_ingredient(stock_ht, recipe, amount) == -1) {
+      // Send at once the orders of the run that arrived before the next order
+      // of any other bucket, as many as the stocks allow
+      int first = bucket->run_firsts[r];
+      int limit = bucket->run_ends[r] - first;
+      if (n > 1) {
+        int next_arrival = waiting_heap_arrival(queue->heap[1]);
+        if (n > 2 && waiting_heap_arrival(queue->heap[2]) < next_arrival) {
+          next_arrival = waiting_heap_arrival(queue->heap[2]);
+        }
+        limit = stock_upper_bound(bucket->arrivals, first, bucket->run_ends[r],
+                                  next_arrival - 1) -
+                first;
+      }
+      truck_prev = send_order_run(queue, stock_ht, recipe, r, limit,
+                                  truck_queue, truck_prev);
+
+      // A run left non-empty stays under the cursor: either another bucket
+      // comes first or its next order fails on the following check
+      if (bucket->run_firsts[r] == bucket->run_ends[r]) {
+        recipe->cursor = waiting_bucket_next_run(bucket, r + 1);
+        if (r == bucket->first_run) {
+          bucket->first_run = recipe->cursor;
+        }
+      }
+    } else if (recipe->blocked_amount <= recipe->min_amount) {
+      // Every order left in the bucket is blocked by the same stock
+      recipe_watch(stock_ht, recipe, recipe->blocked_id);
+      waiting_queue_relieve(queue, recipe);
+      queue->heap[0] = queue->heap[--n];
+      if (n > 0) {
+        waiting_heap_sift_down(queue->heap, n, 0);
+      }
+      continue;
     } else {
-      // order_cache_ht_add(cache, create_order_node(node->order));
-      prev_node = node;
+      // The rest of the run has the same amount and fails as well
+      recipe->cursor = waiting_bucket_next_run(bucket, r + 1);
+      if (amount < recipe->scan_min) {
+        recipe->scan_min = amount;
+      }
     }
-    node = next;
-  }
 
-  // free_order_cache_ht(cache);
+    // Stream the spilled orders in, moving out the ones that failed first if
+    // memory is short
+    bool stalled = false;
+    while (recipe->cursor == bucket->n_runs && !stalled &&
+           (bucket->n_segments > bucket->n_scanned || bucket->n_pending > 0)) {
+      if (SPILL_RESIDENT_LIMIT > 0 && queue->n_resident > SPILL_RESIDENT_LIMIT) {
+        waiting_queue_spill(queue, recipe);
+      }
+      stalled = !waiting_queue_load(queue, recipe);
+    }
+    if (stalled) {
+      // Left pending until the next restock
+      recipe->watching = WATCH_PENDING;
+      waiting_queue_push_woken(queue, recipe);
+      queue->in_sync = false;
+      waiting_queue_relieve(queue, recipe);
+      queue->heap[0] = queue->heap[--n];
+      if (n > 0) {
+        waiting_heap_sift_down(queue->heap, n, 0);
+      }
+      continue;
+    }
+    if (recipe->cursor == bucket->n_runs) {
+      // Every order left failed since the restock, the smallest one last
+      // recorded as the recipe's blocked amount
+      recipe->min_amount = recipe->scan_min;
+      if (bucket->n_live > 0 || bucket->n_spilled > 0) {
+        recipe_watch(stock_ht, recipe, recipe->blocked_id);
+      }
+      waiting_queue_relieve(queue, recipe);
+      queue->heap[0] = queue->heap[--n];
+    }
+    if (n > 0) {
+      waiting_heap_sift_down(queue->heap, n, 0);
+    }
+  }
 }
 
 void handle_order(RecipeHT *recipe_ht, StockHT *stock_ht,
-                  OrderQueue *waiting_queue, OrderQueue *truck_queue,
+                  WaitingQueue *waiting_queue, OrderQueue *truck_queue,
                   char *line) {
   char *command = strtok(line, " ");
   if (command == NULL) {
@@ -1193,11 +4060,34 @@ void handle_order(RecipeHT *recipe_ht, StockHT *stock_ht,
   }
   printf("accettato\n");
 
-  Order *order = create_order(recipe, amount, CURR_TIME);
-  try_send_order(stock_ht, waiting_queue, truck_queue, order, false);
+  try_send_order(waiting_queue, stock_ht, truck_queue, recipe, amount,
+                 CURR_TIME);
+}
+
+// Withdraw a waiting order, identified by its arrival time. Orders already
+// prepared are left for the truck.
+void handle_cancel(StockHT *stock_ht, WaitingQueue *waiting_queue,
+                   char *line) {
+  char *command = strtok(line, " ");
+  if (command == NULL) {
+    return;
+  }
+
+  char *arrival_str = strtok(NULL, " ");
+  if (arrival_str == NULL) {
+    return;
+  }
+
+  if (waiting_queue_cancel(waiting_queue, stock_ht, atoi(arrival_str))) {
+    printf("annullato\n");
+  } else {
+    printf("non in attesa\n");
+  }
 }
 
-void handle_truck(char *line) {
+// Replace the couriers with the ones the line lists, as pairs of period and
+// capacity. A line without a whole pair leaves them as they are.
+void handle_truck(Fleet *fleet, Scheduler *scheduler, char *line) {
   char *time = strtok(line, " ");
   if (time == NULL) {
     return;
@@ -1206,28 +4096,41 @@ void handle_truck(char *line) {
   if (weight == NULL) {
     return;
   }
-  TRUCK_TIME = atoi(time);
-  TRUCK_WEIGHT = atoi(weight);
+
+  fleet_clear(fleet, scheduler);
+  while (time != NULL && weight != NULL) {
+    fleet_add(fleet, scheduler, atoi(time), atoi(weight));
+    time = strtok(NULL, " ");
+    weight = time != NULL ? strtok(NULL, " ") : NULL;
+  }
 }
 // END UTIL IMPLEMENTATION ==========================
 
 int main(void) {
+  ORDER_POOL = create_pool(sizeof(Order), _Alignof(Order), POOL_INIT_ORDERS);
+  RECIPE_POOL =
+      create_pool(sizeof(Recipe), _Alignof(Recipe), POOL_INIT_RECIPES);
   RecipeHT *recipe_ht = create_recipe_ht(HT_INIT_SIZE_RECIPE);
   StockHT *stock_ht = create_stock_ht(HT_INIT_SIZE_INGREDIENT);
-  OrderQueue *waiting_queue = create_order_queue();
+  WaitingQueue *waiting_queue = create_waiting_queue();
   OrderQueue *truck_queue = create_order_queue();
+  Fleet *fleet = create_fleet();
+  Scheduler *scheduler = create_scheduler();
 
   char command[4];
   char *line;
+  size_t line_size = LINE_SIZE;
+  char *line_buffer = (char *)malloc(line_size);
+  if (line_buffer == NULL) {
+    line_size = 0;
+  }
 
-  while ((line = read_line(stdin)) != NULL) {
-    if (CURR_TIME != 0 && TRUCK_TIME != 0 && CURR_TIME % TRUCK_TIME == 0) {
-      order_queue_dequeue(truck_queue);
-    }
+  while ((line = read_line(stdin, &line_buffer, &line_size)) != NULL) {
+    scheduler_run(scheduler, fleet, truck_queue);
 
     if (sscanf(line, "%3s", command) == 1) {
       if (strcmp(command, "agg") == 0) {
-        add_recipe(recipe_ht, line);
+        add_recipe(recipe_ht, stock_ht, line);
         CURR_TIME++;
       } else if (strcmp(command, "rim") == 0) {
         remove_recipe(recipe_ht, line);
@@ -1238,21 +4141,37 @@ int main(void) {
       } else if (strcmp(command, "ord") == 0) {
         handle_order(recipe_ht, stock_ht, waiting_queue, truck_queue, line);
         CURR_TIME++;
+      } else if (strcmp(command, "ann") == 0) {
+        handle_cancel(stock_ht, waiting_queue, line);
+        CURR_TIME++;
       } else {
-        handle_truck(line);
+        handle_truck(fleet, scheduler, line);
       }
     }
-
-    free(line);
-  }
-
-  if (CURR_TIME != 0 && TRUCK_TIME != 0 && CURR_TIME % TRUCK_TIME == 0) {
-    order_queue_dequeue(truck_queue);
   }
-
+  free(line_buffer);
+
+  scheduler_run(scheduler, fleet, truck_queue);
+
+#ifdef DEBUG
+  fprintf(stderr, "recipe checks: %ld, ingredients checked per check: %.2f\n",
+          STATS_CHECKS,
+          STATS_CHECKS > 0 ? (double)STATS_INGREDIENTS_CHECKED / STATS_CHECKS
+                           : 0.0);
+  pool_report(ORDER_POOL, "order");
+  pool_report(RECIPE_POOL, "recipe");
+#if SPILL_RESIDENT_LIMIT > 0
+  fprintf(stderr, "spill file: %ld bytes at peak\n", waiting_queue->spill_peak);
+#endif
+#endif
+
+  free_waiting_queue(waiting_queue);
   free_recipe_ht(recipe_ht);
   free_stock_ht(stock_ht);
-  free_order_queue(waiting_queue);
   free_order_queue(truck_queue);
+  free_fleet(fleet);
+  free_scheduler(scheduler);
+  free_pool(ORDER_POOL);
+  free_pool(RECIPE_POOL);
 }
 
@@ -2,6 +2,16 @@
 
 set -e
 
+# Diff ./main on every test case that ships its input
+run_all() {
+  for output in ./test_cases/*.output.txt; do
+    input=${output%.output.txt}.txt
+    if [ -f $input ]; then
+      ./main < $input | diff - $output
+    fi
+  done
+}
+
 # Run the tests
 echo "Running example.txt"
 time ./main < ./test_cases/example.txt > example.out
@@ -45,6 +55,62 @@ diff open6.out ./test_cases/open6.output.txt
 rm open6.out
 echo -e "----------------------\n"
 
+echo "Running annulla.txt"
+time ./main < ./test_cases/annulla.txt > annulla.out
+diff annulla.out ./test_cases/annulla.output.txt
+rm annulla.out
+echo -e "----------------------\n"
+
+echo "Running couriers.txt"
+time ./main < ./test_cases/couriers.txt > couriers.out
+diff couriers.out ./test_cases/couriers.output.txt
+rm couriers.out
+echo -e "----------------------\n"
+
+echo "Running annulla_rimossa.txt"
+time ./main < ./test_cases/annulla_rimossa.txt > annulla_rimossa.out
+diff annulla_rimossa.out ./test_cases/annulla_rimossa.output.txt
+rm annulla_rimossa.out
+echo -e "----------------------\n"
+
+if grep -qw avx2 /proc/cpuinfo; then
+  echo "Running every test case with AVX2 recipe checks"
+  make -s -B main CFLAGS="-Wall -Werror -std=gnu11 -O2 -mavx2"
+  time run_all
+  make -s -B main
+  echo -e "----------------------\n"
+fi
+
+echo "Running every test case with parallel rescans"
+make -s -B main CFLAGS="-Wall -Werror -std=gnu11 -O2 -DPARALLEL_RESCAN=4 -DPARALLEL_MIN_WOKEN=1"
+time run_all
+make -s -B main
+echo -e "----------------------\n"
+
+echo "Running every test case with spilled waiting orders"
+make -s -B main CFLAGS="-Wall -Werror -std=gnu11 -O2 -DSPILL_RESIDENT_LIMIT=1 -DSPILL_MIN_ORDERS=1"
+time run_all
+make -s -B main
+echo -e "----------------------\n"
+
+echo "Running a long shortage with spilled waiting orders"
+make -s -B main CFLAGS="-Wall -Werror -std=gnu11 -O2 -DDEBUG -DSPILL_RESIDENT_LIMIT=100 -DSPILL_MIN_ORDERS=16"
+# 20000 waiting orders of 8 bytes each, rescanned by 2000 restocks that
+# release one at a time: the spill file must stay within twice their size
+awk 'BEGIN {
+  print 1000000000, 1
+  print "aggiungi_ricetta torta farina 1 lievito 1"
+  print "rifornimento farina 1000000000 1000000000"
+  for (i = 0; i < 20000; i++) print "ordine torta", 1 + i % 2
+  for (i = 0; i < 2000; i++) print "rifornimento lievito 1 1000000000"
+}' > shortage.txt
+peak=$(./main < shortage.txt 2>&1 > /dev/null | awk '/^spill file:/ { print $3 }')
+rm shortage.txt
+echo "Spill file peak: $peak bytes"
+test "$peak" -le 320000
+make -s -B main
+echo -e "----------------------\n"
+
 echo "Running open7.txt"
 time ./main < ./test_cases/open7.txt > open7.out
 diff open7.out ./test_cases/open7.output.txt